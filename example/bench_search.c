@@ -0,0 +1,95 @@
+/* Measures the latency of anm_get_key_interval against the number of keys.
+ *
+ * The makefile builds this twice, from the library sources, with the search
+ * index thresholds overriden: bench_bisect never uses the index, and
+ * bench_index always does. Run both (make bench) to compare bisection with
+ * the index at each track size, for both key layouts. The crossover points
+ * are the INDEX_MIN_KEYS and INDEX_MIN_KEYS_SOA thresholds in src/track.c.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "track.h"
+
+#ifndef BENCH_NAME
+#define BENCH_NAME	"search"
+#endif
+
+#define MIN_KEYS	4
+#define MAX_KEYS	(4 << 20)
+#define NUM_QUERIES	(1 << 20)
+#define NUM_RUNS	5
+
+static double bench(struct anm_track *trk, const anm_time_t *queries);
+static double get_nsec(void);
+
+int main(void)
+{
+	int i, nkeys;
+	anm_time_t *queries;
+	struct anm_track trk;
+	struct anm_keyframe key;
+	double aos, soa;
+
+	if(!(queries = malloc(NUM_QUERIES * sizeof *queries))) {
+		perror("failed to allocate queries");
+		return 1;
+	}
+
+	printf("%s: mean lookup latency in ns for random times\n", BENCH_NAME);
+	printf("%10s %8s %8s\n", "keys", "aos", "soa");
+
+	for(nkeys=MIN_KEYS; nkeys<=MAX_KEYS; nkeys<<=2) {
+		if(anm_init_track(&trk) == -1) {
+			fprintf(stderr, "failed to initialize track\n");
+			return 1;
+		}
+		for(i=0; i<nkeys; i++) {
+			key.time = i * 10;
+			key.val = (float)rand() / (float)RAND_MAX;
+			if(anm_set_keyframe(&trk, &key) == -1) {
+				fprintf(stderr, "failed to add keyframe\n");
+				return 1;
+			}
+		}
+		for(i=0; i<NUM_QUERIES; i++) {
+			queries[i] = ((anm_time_t)rand() * 65536 + rand()) % ((anm_time_t)nkeys * 10);
+		}
+
+		aos = bench(&trk, queries);
+		anm_set_track_layout(&trk, ANM_KEYS_SOA);
+		soa = bench(&trk, queries);
+
+		printf("%10d %8.1f %8.1f\n", nkeys, aos, soa);
+		anm_destroy_track(&trk);
+	}
+
+	free(queries);
+	return 0;
+}
+
+/* best of NUM_RUNS passes over the queries, in ns per lookup */
+static double bench(struct anm_track *trk, const anm_time_t *queries)
+{
+	int i, j;
+	volatile int sink = 0;
+	double t0, dt, best = 0.0;
+
+	anm_update_track(trk);	/* build the index up front, if it's used */
+	for(i=0; i<NUM_RUNS; i++) {
+		t0 = get_nsec();
+		for(j=0; j<NUM_QUERIES; j++) {
+			sink += anm_get_key_interval(trk, queries[j]);
+		}
+		dt = get_nsec() - t0;
+		if(!i || dt < best) best = dt;
+	}
+	return best / NUM_QUERIES;
+}
+
+static double get_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
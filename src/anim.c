@@ -21,41 +21,126 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <assert.h>
 #include "anim.h"
 #include "dynarr.h"
+#include "pool.h"
 
 #include "cgmath/cgmath.h"
 
 #define ROT_USE_SLERP
 
+/* The node_position/rotation/scaling functions take an optional set of
+ * lookup cursors, one for each active animation. Shared cursors are passed to
+ * all three, and only used if the channels of the animation share their key
+ * times. Then the keyframe interval is found by the first channel evaluated,
+ * and the rest find it in the cursor. Cursors which aren't shared are
+ * dedicated to a single channel, and always used.
+ */
+struct anm_node_cursor {
+	struct anm_cursor cur[2];
+	int shared;
+};
+
+#define ANIM_CURSOR(anim, nc, which) \
+	((nc) && (!(nc)->shared || (anim)->times) ? (nc)->cur + (which) : 0)
+
+static int simplify_animation(struct anm_animation *anim, float pos_err, float rot_err, float scl_err);
+static int alloc_node_id(unsigned int *rev);
+static void free_node_id(int id, unsigned int rev);
+static struct anm_mat_cache *get_cache(struct anm_node *node, anm_time_t tm,
+		struct anm_eval_context *ctx);
+static unsigned int update_cache(struct anm_node *node, anm_time_t tm,
+		struct anm_eval_context *ctx);
+static struct anm_mat_cache *get_prs_cache(struct anm_node *node, anm_time_t tm,
+		struct anm_eval_context *ctx);
+static void update_prs_cache(struct anm_node *node, anm_time_t tm,
+		struct anm_eval_context *ctx);
+static struct anm_eval_context *thread_context(void);
 static void invalidate_cache(struct anm_node *node);
+static void anim_revs(const struct anm_node *node, unsigned int *arev);
+static void tree_changed(struct anm_node *node);
+static void node_position(struct anm_node *node, float *pos, anm_time_t tm, struct anm_node_cursor *cur);
+static void node_rotation(struct anm_node *node, float *qrot, anm_time_t tm, struct anm_node_cursor *cur);
+static void node_scaling(struct anm_node *node, float *scale, anm_time_t tm, struct anm_node_cursor *cur);
+static void node_matrix(struct anm_node *node, float *mat, anm_time_t tm, struct anm_node_cursor *pcur,
+		struct anm_node_cursor *rcur, struct anm_node_cursor *scur);
+static void init_node_cursor(struct anm_node_cursor *nc, int shared);
+static int flatten_tree(struct anm_node *node, int parent, struct anm_node ***nodes, int **parents);
+static int flatten(struct anm_flat_tree *ft);
+struct eval_split;
+static int split_tree(struct anm_node *node, struct eval_split *es);
+static void eval_task(void *cls, int idx);
+static int bake(struct anm_node *tree, anm_time_t start, anm_time_t period, int count,
+		float *prs, float *mat);
+static void bake_chunk(void *cls, int idx);
+static void get_node_vec3(float *res, struct anm_vec3_track *vtrk, struct anm_track *trk,
+		anm_time_t tm, struct anm_cursor *cur);
+
+#ifdef __GNUC__
+#define PREFETCH(p)	__builtin_prefetch(p)
+#else
+#define PREFETCH(p)
+#endif
+
+/* legacy scalar tracks are only allocated if requested with anm_get_animation_track */
+#define LEGACY_TRACK(anim, idx) \
+	((anim)->tracks ? (anim)->tracks + (idx) : 0)
+
+/* Node ids are allocated densely, reusing the ids of destroyed nodes first,
+ * so that evaluation contexts can keep their caches in a flat array. A reused
+ * id continues from the revision of the destroyed node, so that its cached
+ * matrices are never mistaken for those of the new node.
+ */
+struct free_id {
+	int id;
+	unsigned int rev;
+};
+
+static int next_node_id;
+static struct free_id *free_node_ids;
+
+/* number of changes to any node, see update_cache */
+static unsigned int edit_count = 1;
+
+#ifdef ANIM_THREAD_SAFE
+static pthread_mutex_t node_id_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t ctx_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ctx_key;
+#else
+static struct anm_eval_context def_ctx;
+#endif
 
 int anm_init_animation(struct anm_animation *anim)
 {
-	int i, j;
-	static const float defaults[] = {
-		0.0f, 0.0f, 0.0f,		/* default position */
-		0.0f, 0.0f, 0.0f, 1.0f,	/* default rotation quat */
-		1.0f, 1.0f, 1.0f		/* default scale factor */
-	};
+	static const float def_scale[] = {1.0f, 1.0f, 1.0f};
 
+	/* nothing is allocated until keyframes are added to a channel, and the
+	 * legacy scalar tracks only if they are requested explicitly.
+	 */
 	anim->name = 0;
-
-	for(i=0; i<ANM_NUM_TRACKS; i++) {
-		if(anm_init_track(anim->tracks + i) == -1) {
-			for(j=0; j<i; j++) {
-				anm_destroy_track(anim->tracks + i);
-			}
-		}
-		anm_set_track_default(anim->tracks + i, defaults[i]);
-	}
+	anim->tracks = 0;
+	anim->times = 0;
+	anim->rev = 0;
+
+	anm_init_vec3_track(&anim->pos);
+	anm_init_quat_track(&anim->rot);
+	anm_init_vec3_track(&anim->scl);
+	anm_set_vec3_track_default(&anim->scl, def_scale);
 	return 0;
 }
 
 void anm_destroy_animation(struct anm_animation *anim)
 {
 	int i;
-	for(i=0; i<ANM_NUM_TRACKS; i++) {
-		anm_destroy_track(anim->tracks + i);
+
+	if(anim->tracks) {
+		for(i=0; i<ANM_NUM_TRACKS; i++) {
+			anm_destroy_track(anim->tracks + i);
+		}
+		free(anim->tracks);
 	}
+	anm_destroy_vec3_track(&anim->pos);
+	anm_destroy_quat_track(&anim->rot);
+	anm_destroy_vec3_track(&anim->scl);
+	anm_dynarr_free(anim->times);
 	free(anim->name);
 }
 
@@ -70,6 +155,145 @@ void anm_set_animation_name(struct anm_animation *anim, const char *name)
 	anim->name = newname;
 }
 
+struct anm_track *anm_get_animation_track(struct anm_animation *anim, int idx)
+{
+	int i;
+	struct anm_track *tracks;
+	static const float defaults[] = {
+		0.0f, 0.0f, 0.0f,		/* default position */
+		0.0f, 0.0f, 0.0f, 1.0f,	/* default rotation quat */
+		1.0f, 1.0f, 1.0f		/* default scale factor */
+	};
+
+	if(idx < 0 || idx >= ANM_NUM_TRACKS) {
+		return 0;
+	}
+
+	if(!anim->tracks) {
+		if(!(tracks = malloc(ANM_NUM_TRACKS * sizeof *tracks))) {
+			return 0;
+		}
+		for(i=0; i<ANM_NUM_TRACKS; i++) {
+			anm_init_track(tracks + i);
+			anm_set_track_default(tracks + i, defaults[i]);
+			anm_set_track_interpolator(tracks + i, anim->rot.interp);
+			anm_set_track_extrapolator(tracks + i, anim->rot.extrap);
+		}
+		anm_set_track_option(tracks + ANM_TRACK_ROT_X, ANM_TRACK_SLERP_CACHE, 1);
+		anim->tracks = tracks;
+	}
+	return anim->tracks + idx;
+}
+
+int anm_share_animation_times(struct anm_animation *anim)
+{
+	int i, count = 0;
+	anm_time_t *times = 0, *shared;
+	anm_time_t **chan_times[3];
+	int *chan_shared[3], chan_count[3];
+
+	chan_times[0] = &anim->pos.times;
+	chan_times[1] = &anim->rot.times;
+	chan_times[2] = &anim->scl.times;
+	chan_shared[0] = &anim->pos.times_shared;
+	chan_shared[1] = &anim->rot.times_shared;
+	chan_shared[2] = &anim->scl.times_shared;
+	chan_count[0] = anim->pos.count;
+	chan_count[1] = anim->rot.count;
+	chan_count[2] = anim->scl.count;
+
+	/* all channels with keyframes must have the same key times */
+	for(i=0; i<3; i++) {
+		if(!chan_count[i]) continue;
+
+		if(!times) {
+			times = *chan_times[i];
+			count = chan_count[i];
+		} else if(chan_count[i] != count || memcmp(*chan_times[i], times, count * sizeof *times) != 0) {
+			return -1;
+		}
+	}
+	if(!times) {
+		return 0;
+	}
+
+	if(!(shared = anm_dynarr_alloc(count, sizeof *shared))) {
+		return -1;
+	}
+	memcpy(shared, times, count * sizeof *shared);
+
+	for(i=0; i<3; i++) {
+		if(!chan_count[i]) continue;
+
+		if(!*chan_shared[i]) {
+			anm_dynarr_free(*chan_times[i]);
+		}
+		*chan_times[i] = shared;
+		*chan_shared[i] = 1;
+	}
+
+	/* any previously shared array isn't used by any channel anymore */
+	anm_dynarr_free(anim->times);
+	anim->times = shared;
+	return 0;
+}
+
+int anm_simplify_animation(struct anm_animation *anim, float pos_err, float rot_err, float scl_err)
+{
+	int res = simplify_animation(anim, pos_err, rot_err, scl_err);
+
+	/* even if it failed, some tracks may have changed already */
+	anim->rev++;
+	edit_count++;
+	return res;
+}
+
+static int simplify_animation(struct anm_animation *anim, float pos_err, float rot_err, float scl_err)
+{
+	int res, nrem = 0;
+	struct anm_track *trk[3];
+
+	if((res = anm_simplify_vec3_track(&anim->pos, pos_err)) == -1) {
+		return -1;
+	}
+	nrem += res;
+	if((res = anm_simplify_quat_track(&anim->rot, rot_err)) == -1) {
+		return -1;
+	}
+	nrem += res;
+	if((res = anm_simplify_vec3_track(&anim->scl, scl_err)) == -1) {
+		return -1;
+	}
+	nrem += res;
+
+	if(!anim->tracks) {
+		return nrem;
+	}
+
+	trk[0] = anim->tracks + ANM_TRACK_POS_X;
+	trk[1] = anim->tracks + ANM_TRACK_POS_Y;
+	trk[2] = anim->tracks + ANM_TRACK_POS_Z;
+	if((res = anm_simplify_tracks(trk, 3, pos_err)) == -1) {
+		return -1;
+	}
+	nrem += res;
+
+	res = anm_simplify_quat(anim->tracks + ANM_TRACK_ROT_X, anim->tracks + ANM_TRACK_ROT_Y,
+			anim->tracks + ANM_TRACK_ROT_Z, anim->tracks + ANM_TRACK_ROT_W, rot_err);
+	if(res == -1) {
+		return -1;
+	}
+	nrem += res;
+
+	trk[0] = anim->tracks + ANM_TRACK_SCL_X;
+	trk[1] = anim->tracks + ANM_TRACK_SCL_Y;
+	trk[2] = anim->tracks + ANM_TRACK_SCL_Z;
+	if((res = anm_simplify_tracks(trk, 3, scl_err)) == -1) {
+		return -1;
+	}
+	return nrem + res;
+}
+
 /* ---- node implementation ----- */
 
 int anm_init_node(struct anm_node *node)
@@ -77,6 +301,7 @@ int anm_init_node(struct anm_node *node)
 	memset(node, 0, sizeof *node);
 
 	node->cur_anim[1] = -1;
+	node->blend_dur = -1;	/* not in transition */
 
 	if(!(node->animations = anm_dynarr_alloc(1, sizeof *node->animations))) {
 		return -1;
@@ -86,12 +311,11 @@ int anm_init_node(struct anm_node *node)
 		return -1;
 	}
 
-#ifdef ANIM_THREAD_SAFE
-	/* initialize thread-local matrix cache */
-	pthread_key_create(&node->cache_key, 0);
-	pthread_mutex_init(&node->cache_list_lock, 0);
-#endif
-
+	if((node->id = alloc_node_id(&node->rev)) == -1) {
+		anm_destroy_animation(node->animations);
+		anm_dynarr_free(node->animations);
+		return -1;
+	}
 	return 0;
 }
 
@@ -106,16 +330,9 @@ void anm_destroy_node(struct anm_node *node)
 	}
 	anm_dynarr_free(node->animations);
 
-#ifdef ANIM_THREAD_SAFE
-	/* destroy thread-specific cache */
-	pthread_key_delete(node->cache_key);
-
-	while(node->cache_list) {
-		struct mat_cache *tmp = node->cache_list;
-		node->cache_list = tmp->next;
-		free(tmp);
-	}
-#endif
+	/* cached matrices of a node reusing the id must not be taken as current */
+	invalidate_cache(node);
+	free_node_id(node->id, node->rev);
 }
 
 void anm_destroy_node_tree(struct anm_node *tree)
@@ -194,6 +411,7 @@ void anm_link_node(struct anm_node *p, struct anm_node *c)
 	p->child = c;
 
 	c->parent = p;
+	tree_changed(p);
 	invalidate_cache(c);
 }
 
@@ -204,18 +422,23 @@ int anm_unlink_node(struct anm_node *p, struct anm_node *c)
 	if(p->child == c) {
 		p->child = c->next;
 		c->next = 0;
+		c->parent = 0;
+		tree_changed(p);
 		invalidate_cache(c);
 		return 0;
 	}
 
 	iter = p->child;
-	while(iter->next) {
+	while(iter && iter->next) {
 		if(iter->next == c) {
 			iter->next = c->next;
 			c->next = 0;
+			c->parent = 0;
+			tree_changed(p);
 			invalidate_cache(c);
 			return 0;
 		}
+		iter = iter->next;
 	}
 	return -1;
 }
@@ -225,6 +448,7 @@ void anm_set_pivot(struct anm_node *node, float x, float y, float z)
 	node->pivot[0] = x;
 	node->pivot[1] = y;
 	node->pivot[2] = z;
+	invalidate_cache(node);
 }
 
 void anm_get_pivot(struct anm_node *node, float *x, float *y, float *z)
@@ -453,9 +677,12 @@ void anm_set_interpolator(struct anm_node *node, enum anm_interpolator in)
 	struct anm_animation *anim = anm_get_active_animation(node, 0);
 	if(!anim) return;
 
-	for(i=0; i<ANM_NUM_TRACKS; i++) {
+	for(i=0; anim->tracks && i<ANM_NUM_TRACKS; i++) {
 		anm_set_track_interpolator(anim->tracks + i, in);
 	}
+	anm_set_vec3_track_interpolator(&anim->pos, in);
+	anm_set_quat_track_interpolator(&anim->rot, in);
+	anm_set_vec3_track_interpolator(&anim->scl, in);
 	invalidate_cache(node);
 }
 
@@ -465,9 +692,12 @@ void anm_set_extrapolator(struct anm_node *node, enum anm_extrapolator ex)
 	struct anm_animation *anim = anm_get_active_animation(node, 0);
 	if(!anim) return;
 
-	for(i=0; i<ANM_NUM_TRACKS; i++) {
+	for(i=0; anim->tracks && i<ANM_NUM_TRACKS; i++) {
 		anm_set_track_extrapolator(anim->tracks + i, ex);
 	}
+	anm_set_vec3_track_extrapolator(&anim->pos, ex);
+	anm_set_quat_track_extrapolator(&anim->rot, ex);
+	anm_set_vec3_track_extrapolator(&anim->scl, ex);
 	invalidate_cache(node);
 }
 
@@ -561,16 +791,23 @@ void anm_set_position(struct anm_node *node, const float *pos, anm_time_t tm)
 
 void anm_set_position3f(struct anm_node *node, float x, float y, float z, anm_time_t tm)
 {
+	float v[3];
 	struct anm_animation *anim = anm_get_active_animation(node, 0);
 	if(!anim) return;
 
-	anm_set_value(anim->tracks + ANM_TRACK_POS_X, tm, x);
-	anm_set_value(anim->tracks + ANM_TRACK_POS_Y, tm, y);
-	anm_set_value(anim->tracks + ANM_TRACK_POS_Z, tm, z);
+	v[0] = x;
+	v[1] = y;
+	v[2] = z;
+	anm_set_vec3_keyframe(&anim->pos, tm, v);
 	invalidate_cache(node);
 }
 
 void anm_get_node_position(struct anm_node *node, float *pos, anm_time_t tm)
+{
+	node_position(node, pos, tm, 0);
+}
+
+static void node_position(struct anm_node *node, float *pos, anm_time_t tm, struct anm_node_cursor *cur)
 {
 	anm_time_t tm0 = animation_time(node, tm, 0);
 	struct anm_animation *anim0 = anm_get_active_animation(node, 0);
@@ -581,19 +818,18 @@ void anm_get_node_position(struct anm_node *node, float *pos, anm_time_t tm)
 		return;
 	}
 
-	pos[0] = anm_get_value(anim0->tracks + ANM_TRACK_POS_X, tm0);
-	pos[1] = anm_get_value(anim0->tracks + ANM_TRACK_POS_Y, tm0);
-	pos[2] = anm_get_value(anim0->tracks + ANM_TRACK_POS_Z, tm0);
+	get_node_vec3(pos, &anim0->pos, LEGACY_TRACK(anim0, ANM_TRACK_POS_X), tm0,
+			ANIM_CURSOR(anim0, cur, 0));
 
 	if(anim1) {
+		float p1[3];
 		anm_time_t tm1 = animation_time(node, tm, 1);
-		float x1 = anm_get_value(anim1->tracks + ANM_TRACK_POS_X, tm1);
-		float y1 = anm_get_value(anim1->tracks + ANM_TRACK_POS_Y, tm1);
-		float z1 = anm_get_value(anim1->tracks + ANM_TRACK_POS_Z, tm1);
+		get_node_vec3(p1, &anim1->pos, LEGACY_TRACK(anim1, ANM_TRACK_POS_X), tm1,
+				ANIM_CURSOR(anim1, cur, 1));
 
-		pos[0] = pos[0] + (x1 - pos[0]) * node->cur_mix;
-		pos[1] = pos[1] + (y1 - pos[1]) * node->cur_mix;
-		pos[2] = pos[2] + (z1 - pos[2]) * node->cur_mix;
+		pos[0] = pos[0] + (p1[0] - pos[0]) * node->cur_mix;
+		pos[1] = pos[1] + (p1[1] - pos[1]) * node->cur_mix;
+		pos[2] = pos[2] + (p1[2] - pos[2]) * node->cur_mix;
 	}
 }
 
@@ -604,13 +840,15 @@ void anm_set_rotation(struct anm_node *node, const float *qrot, anm_time_t tm)
 
 void anm_set_rotation4f(struct anm_node *node, float x, float y, float z, float w, anm_time_t tm)
 {
+	float q[4];
 	struct anm_animation *anim = anm_get_active_animation(node, 0);
 	if(!anim) return;
 
-	anm_set_value(anim->tracks + ANM_TRACK_ROT_X, tm, x);
-	anm_set_value(anim->tracks + ANM_TRACK_ROT_Y, tm, y);
-	anm_set_value(anim->tracks + ANM_TRACK_ROT_Z, tm, z);
-	anm_set_value(anim->tracks + ANM_TRACK_ROT_W, tm, w);
+	q[0] = x;
+	q[1] = y;
+	q[2] = z;
+	q[3] = w;
+	anm_set_quat_keyframe(&anim->rot, tm, q);
 	invalidate_cache(node);
 }
 
@@ -622,79 +860,56 @@ void anm_set_rotation_axis(struct anm_node *node, float angle, float x, float y,
 	anm_set_rotation(node, (float*)&q, tm);
 }
 
-static void get_node_rotation(cgm_quat *qres, struct anm_node *node, anm_time_t tm, struct anm_animation *anim)
+/* evaluates a position or scaling track, or the corresponding scalar tracks
+ * starting at trk, if keyframes were set on those directly.
+ */
+static void get_node_vec3(float *res, struct anm_vec3_track *vtrk, struct anm_track *trk,
+		anm_time_t tm, struct anm_cursor *cur)
 {
-#ifndef ROT_USE_SLERP
-	qres->x = anm_get_value(anim->tracks + ANM_TRACK_ROT_X, tm);
-	qres->y = anm_get_value(anim->tracks + ANM_TRACK_ROT_Y, tm);
-	qres->z = anm_get_value(anim->tracks + ANM_TRACK_ROT_Z, tm);
-	qres->w = anm_get_value(anim->tracks + ANM_TRACK_ROT_W, tm);
-#else
-	int idx0, idx1, last_idx;
-	anm_time_t tstart, tend;
-	float t, dt;
-	struct anm_track *track_x, *track_y, *track_z, *track_w;
-	cgm_quat q1, q2;
-
-	track_x = anim->tracks + ANM_TRACK_ROT_X;
-	track_y = anim->tracks + ANM_TRACK_ROT_Y;
-	track_z = anim->tracks + ANM_TRACK_ROT_Z;
-	track_w = anim->tracks + ANM_TRACK_ROT_W;
-
-	if(!track_x->count) {
-		qres->x = track_x->def_val;
-		qres->y = track_y->def_val;
-		qres->z = track_z->def_val;
-		qres->w = track_w->def_val;
-		return;
-	}
-
-	last_idx = track_x->count - 1;
-
-	tstart = track_x->keys[0].time;
-	tend = track_x->keys[last_idx].time;
-
-	if(tstart == tend) {
-		qres->x = track_x->keys[0].val;
-		qres->y = track_y->keys[0].val;
-		qres->z = track_z->keys[0].val;
-		qres->w = track_w->keys[0].val;
+	if(vtrk->count || !trk || !(trk[0].count | trk[1].count | trk[2].count)) {
+		if(cur) {
+			anm_get_vec3_value_cursor(vtrk, tm, res, cur);
+		} else {
+			anm_get_vec3_value(vtrk, tm, res);
+		}
 		return;
 	}
+	res[0] = anm_get_value(trk, tm);
+	res[1] = anm_get_value(trk + 1, tm);
+	res[2] = anm_get_value(trk + 2, tm);
+}
 
-	tm = anm_remap_time(track_x, tm, tstart, tend);
-
-	idx0 = anm_get_key_interval(track_x, tm);
-	assert(idx0 >= 0 && idx0 < track_x->count);
-	idx1 = idx0 + 1;
-
-	if(idx0 == last_idx) {
-		qres->x = track_x->keys[idx0].val;
-		qres->y = track_y->keys[idx0].val;
-		qres->z = track_z->keys[idx0].val;
-		qres->w = track_w->keys[idx0].val;
+static void get_node_rotation(cgm_quat *qres, struct anm_node *node, anm_time_t tm,
+		struct anm_animation *anim, struct anm_cursor *cur)
+{
+	if(anim->rot.count || !anim->tracks || !anim->tracks[ANM_TRACK_ROT_X].count) {
+		if(cur) {
+			anm_get_quat_value_cursor(&anim->rot, tm, &qres->x, cur);
+		} else {
+			anm_get_quat_value(&anim->rot, tm, &qres->x);
+		}
 		return;
 	}
 
-	dt = (float)(track_x->keys[idx1].time - track_x->keys[idx0].time);
-	t = (float)(tm - track_x->keys[idx0].time) / dt;
-
-	q1.x = track_x->keys[idx0].val;
-	q1.y = track_y->keys[idx0].val;
-	q1.z = track_z->keys[idx0].val;
-	q1.w = track_w->keys[idx0].val;
-
-	q2.x = track_x->keys[idx1].val;
-	q2.y = track_y->keys[idx1].val;
-	q2.z = track_z->keys[idx1].val;
-	q2.w = track_w->keys[idx1].val;
-
-	cgm_qslerp(qres, &q1, &q2, t);
+	/* keyframes set directly on the per-component rotation tracks */
+#ifndef ROT_USE_SLERP
+	qres->x = anm_get_value(anim->tracks + ANM_TRACK_ROT_X, tm);
+	qres->y = anm_get_value(anim->tracks + ANM_TRACK_ROT_Y, tm);
+	qres->z = anm_get_value(anim->tracks + ANM_TRACK_ROT_Z, tm);
+	qres->w = anm_get_value(anim->tracks + ANM_TRACK_ROT_W, tm);
+#else
+	anm_get_quat(anim->tracks + ANM_TRACK_ROT_X, anim->tracks + ANM_TRACK_ROT_Y,
+			anim->tracks + ANM_TRACK_ROT_Z, anim->tracks + ANM_TRACK_ROT_W, tm, &qres->x);
 #endif
 }
 
 //get_node_rotation(cgm_quat *qres, struct anm_node *node, anm_time_t tm, struct anm_animation *anim)
 void anm_get_node_rotation(struct anm_node *node, float *qrot, anm_time_t tm)
+{
+	node_rotation(node, qrot, tm, 0);
+}
+
+static void node_rotation(struct anm_node *node, float *qrot, anm_time_t tm, struct anm_node_cursor *cur)
 {
 	anm_time_t tm0 = animation_time(node, tm, 0);
 	struct anm_animation *anim0 = anm_get_active_animation(node, 0);
@@ -711,12 +926,12 @@ void anm_get_node_rotation(struct anm_node *node, float *qrot, anm_time_t tm)
 		cgm_quat q0, q1;
 		anm_time_t tm1 = animation_time(node, tm, 1);
 
-		get_node_rotation(&q0, node, tm0, anim0);
-		get_node_rotation(&q1, node, tm1, anim1);
+		get_node_rotation(&q0, node, tm0, anim0, ANIM_CURSOR(anim0, cur, 0));
+		get_node_rotation(&q1, node, tm1, anim1, ANIM_CURSOR(anim1, cur, 1));
 
 		cgm_qslerp((cgm_quat*)qrot, &q0, &q1, node->cur_mix);
 	} else {
-		get_node_rotation((cgm_quat*)qrot, node, tm0, anim0);
+		get_node_rotation((cgm_quat*)qrot, node, tm0, anim0, ANIM_CURSOR(anim0, cur, 0));
 	}
 }
 
@@ -727,16 +942,23 @@ void anm_set_scaling(struct anm_node *node, const float *scale, anm_time_t tm)
 
 void anm_set_scaling3f(struct anm_node *node, float x, float y, float z, anm_time_t tm)
 {
+	float v[3];
 	struct anm_animation *anim = anm_get_active_animation(node, 0);
 	if(!anim) return;
 
-	anm_set_value(anim->tracks + ANM_TRACK_SCL_X, tm, x);
-	anm_set_value(anim->tracks + ANM_TRACK_SCL_Y, tm, y);
-	anm_set_value(anim->tracks + ANM_TRACK_SCL_Z, tm, z);
+	v[0] = x;
+	v[1] = y;
+	v[2] = z;
+	anm_set_vec3_keyframe(&anim->scl, tm, v);
 	invalidate_cache(node);
 }
 
 void anm_get_node_scaling(struct anm_node *node, float *scale, anm_time_t tm)
+{
+	node_scaling(node, scale, tm, 0);
+}
+
+static void node_scaling(struct anm_node *node, float *scale, anm_time_t tm, struct anm_node_cursor *cur)
 {
 	anm_time_t tm0 = animation_time(node, tm, 0);
 	struct anm_animation *anim0 = anm_get_active_animation(node, 0);
@@ -747,65 +969,103 @@ void anm_get_node_scaling(struct anm_node *node, float *scale, anm_time_t tm)
 		return;
 	}
 
-	scale[0] = anm_get_value(anim0->tracks + ANM_TRACK_SCL_X, tm0);
-	scale[1] = anm_get_value(anim0->tracks + ANM_TRACK_SCL_Y, tm0);
-	scale[2] = anm_get_value(anim0->tracks + ANM_TRACK_SCL_Z, tm0);
+	get_node_vec3(scale, &anim0->scl, LEGACY_TRACK(anim0, ANM_TRACK_SCL_X), tm0,
+			ANIM_CURSOR(anim0, cur, 0));
 
 	if(anim1) {
+		float s1[3];
 		anm_time_t tm1 = animation_time(node, tm, 1);
-		float x1 = anm_get_value(anim1->tracks + ANM_TRACK_SCL_X, tm1);
-		float y1 = anm_get_value(anim1->tracks + ANM_TRACK_SCL_Y, tm1);
-		float z1 = anm_get_value(anim1->tracks + ANM_TRACK_SCL_Z, tm1);
+		get_node_vec3(s1, &anim1->scl, LEGACY_TRACK(anim1, ANM_TRACK_SCL_X), tm1,
+				ANIM_CURSOR(anim1, cur, 1));
 
-		scale[0] = scale[0] + (x1 - scale[0]) * node->cur_mix;
-		scale[1] = scale[1] + (y1 - scale[1]) * node->cur_mix;
-		scale[2] = scale[2] + (z1 - scale[2]) * node->cur_mix;
+		scale[0] = scale[0] + (s1[0] - scale[0]) * node->cur_mix;
+		scale[1] = scale[1] + (s1[1] - scale[1]) * node->cur_mix;
+		scale[2] = scale[2] + (s1[2] - scale[2]) * node->cur_mix;
 	}
 }
 
 void anm_get_position(struct anm_node *node, float *pos, anm_time_t tm)
+{
+	struct anm_eval_context *ctx = thread_context();
+	assert(ctx);
+	anm_get_position_context(node, pos, tm, ctx);
+}
+
+void anm_get_rotation(struct anm_node *node, float *qrot, anm_time_t tm)
+{
+	struct anm_eval_context *ctx = thread_context();
+	assert(ctx);
+	anm_get_rotation_context(node, qrot, tm, ctx);
+}
+
+void anm_get_scaling(struct anm_node *node, float *scale, anm_time_t tm)
+{
+	struct anm_eval_context *ctx = thread_context();
+	assert(ctx);
+	anm_get_scaling_context(node, scale, tm, ctx);
+}
+
+void anm_get_position_context(struct anm_node *node, float *pos, anm_time_t tm,
+		struct anm_eval_context *ctx)
 {
 	if(!node->parent) {
 		anm_get_node_position(node, pos, tm);
 	} else {
-		float xform[16];
-		anm_get_matrix(node, xform, tm);
+		float *xform = anm_get_matrix_context(node, 0, tm, ctx);
 		cgm_mget_translation(xform, (cgm_vec3*)pos);
 	}
 }
 
-void anm_get_rotation(struct anm_node *node, float *qrot, anm_time_t tm)
+void anm_get_rotation_context(struct anm_node *node, float *qrot, anm_time_t tm,
+		struct anm_eval_context *ctx)
 {
+	struct anm_mat_cache *cache;
+
 	if(!node->parent) {
 		anm_get_node_rotation(node, qrot, tm);
 	} else {
-		cgm_quat rot;
-		anm_get_node_rotation(node, &rot.x, tm);
-		anm_get_rotation(node->parent, qrot, tm);
-		cgm_qmul((cgm_quat*)qrot, &rot);
+		cache = get_prs_cache(node, tm, ctx);
+		qrot[0] = cache->rot[0];
+		qrot[1] = cache->rot[1];
+		qrot[2] = cache->rot[2];
+		qrot[3] = cache->rot[3];
 	}
 }
 
-void anm_get_scaling(struct anm_node *node, float *scale, anm_time_t tm)
+void anm_get_scaling_context(struct anm_node *node, float *scale, anm_time_t tm,
+		struct anm_eval_context *ctx)
 {
-	anm_get_node_scaling(node, scale, tm);
-	if(node->parent) {
-		cgm_vec3 ps;
-		anm_get_scaling(node->parent, &ps.x, tm);
-		cgm_vmul((cgm_vec3*)scale, &ps);
+	struct anm_mat_cache *cache;
+
+	if(!node->parent) {
+		anm_get_node_scaling(node, scale, tm);
+	} else {
+		cache = get_prs_cache(node, tm, ctx);
+		scale[0] = cache->scale[0];
+		scale[1] = cache->scale[1];
+		scale[2] = cache->scale[2];
 	}
 }
 
 void anm_get_node_matrix(struct anm_node *node, float *mat, anm_time_t tm)
+{
+	struct anm_node_cursor cur;
+
+	init_node_cursor(&cur, 1);
+	node_matrix(node, mat, tm, &cur, &cur, &cur);
+}
+
+static void node_matrix(struct anm_node *node, float *mat, anm_time_t tm, struct anm_node_cursor *pcur,
+		struct anm_node_cursor *rcur, struct anm_node_cursor *scur)
 {
 	int i;
 	float rmat[16];
 	cgm_vec3 pos, scale;
 	cgm_quat rot;
 
-	anm_get_node_position(node, &pos.x, tm);
-	anm_get_node_rotation(node, &rot.x, tm);
-	anm_get_node_scaling(node, &scale.x, tm);
+	node_position(node, &pos.x, tm, pcur);
+	node_rotation(node, &rot.x, tm, rcur);
+	node_scaling(node, &scale.x, tm, scur);
 
 	cgm_mtranslation(mat, node->pivot[0], node->pivot[1], node->pivot[2]);
 	cgm_mrotation_quat(rmat, &rot);
@@ -832,6 +1092,13 @@ void anm_get_node_matrix(struct anm_node *node, float *mat, anm_time_t tm)
 	/* that's basically: pivot * rotation * translation * scaling * -pivot */
 }
 
+static void init_node_cursor(struct anm_node_cursor *nc, int shared)
+{
+	anm_init_cursor(nc->cur);
+	anm_init_cursor(nc->cur + 1);
+	nc->shared = shared;
+}
+
 void anm_get_node_inv_matrix(struct anm_node *node, float *mat, anm_time_t tm)
 {
 	anm_get_node_matrix(node, mat, tm);
@@ -862,70 +1129,320 @@ void anm_eval(struct anm_node *node, anm_time_t tm)
 	}
 }
 
-float *anm_get_matrix(struct anm_node *node, float *mat, anm_time_t tm)
+#define EVAL_GRAIN_DEFAULT	64
+
+/* a task of anm_eval_parallel, a number of consecutive sibling subtrees */
+struct eval_task {
+	struct anm_node *first;
+	int count;
+};
+
+struct eval_split {
+	int grain;
+	struct anm_node **upper;	/* nodes above the tasks, in post-order */
+	struct eval_task *tasks;
+	anm_time_t tm;
+	int err;
+};
+
+void anm_eval_parallel(struct anm_node *node, anm_time_t tm, int grain)
 {
-#ifdef ANIM_THREAD_SAFE
-	struct mat_cache *cache = pthread_getspecific(node->cache_key);
-	if(!cache) {
-		cache = malloc(sizeof *cache);
-		assert(cache);
+	int i;
+	struct anm_node *n;
+	struct eval_split es;
+
+	es.grain = grain > 0 ? grain : EVAL_GRAIN_DEFAULT;
+	es.tm = tm;
+	es.err = 0;
+	es.upper = anm_dynarr_alloc(0, sizeof *es.upper);
+	es.tasks = anm_dynarr_alloc(0, sizeof *es.tasks);
+
+	if(anm_pool_size() <= 1 || !es.upper || !es.tasks || split_tree(node, &es) <= es.grain ||
+			es.err) {
+		/* small tree, or out of memory */
+		anm_dynarr_free(es.upper);
+		anm_dynarr_free(es.tasks);
+		anm_eval(node, tm);
+		return;
+	}
+
+	/* reverse post-order puts every node before its descendants */
+	for(i=anm_dynarr_size(es.upper) - 1; i>=0; i--) {
+		n = es.upper[i];
+		anm_eval_node(n, tm);
+		if(n->parent) {
+			cgm_mmul(n->matrix, n->parent->matrix);
+		}
+	}
 
-		pthread_mutex_lock(&node->cache_list_lock);
-		cache->next = node->cache_list;
-		node->cache_list = cache;
-		pthread_mutex_unlock(&node->cache_list_lock);
+	anm_pool_run(eval_task, &es, anm_dynarr_size(es.tasks));
 
-		cache->time = ANM_TIME_INVAL;
-		cache->inv_time = ANM_TIME_INVAL;
-		pthread_setspecific(node->cache_key, cache);
+	anm_dynarr_free(es.upper);
+	anm_dynarr_free(es.tasks);
+}
+
+/* Returns the number of nodes in the subtree of node. Subtrees larger than
+ * the grain size are split: their root is added to the upper nodes, and
+ * runs of consecutive children which fit in the grain size together, become
+ * tasks. Smaller subtrees are left for their parent to group.
+ */
+static int split_tree(struct anm_node *node, struct eval_split *es)
+{
+	int sz, size = 1, ntasks, group = -1, group_size = 0;
+	struct anm_node *c;
+	struct eval_task task;
+	void *tmp;
+
+	/* A transition which has run its course switches the node over to the
+	 * target animation (see animation_time), which counts as an edit. Do that
+	 * here, before the tasks run, so the workers never modify shared state.
+	 */
+	if(node->blend_dur >= 0) {
+		animation_time(node, es->tm, 0);
 	}
-#else
-	struct mat_cache *cache = &node->cache;
-#endif
 
-	if(cache->time != tm) {
-		anm_get_node_matrix(node, cache->matrix, tm);
+	ntasks = anm_dynarr_size(es->tasks);
 
-		if(node->parent) {
-			float parent_mat[16];
+	c = node->child;
+	while(c && !es->err) {
+		/* the task array may be reallocated by split_tree, so the current
+		 * group is kept as an index.
+		 */
+		if((sz = split_tree(c, es)) > es->grain) {
+			group = -1;		/* split subtrees break up runs of siblings */
+		} else if(group >= 0 && group_size + sz <= es->grain) {
+			es->tasks[group].count++;
+			group_size += sz;
+		} else {
+			task.first = c;
+			task.count = 1;
+			if(!(tmp = anm_dynarr_push(es->tasks, &task))) {
+				es->err = 1;
+				break;
+			}
+			es->tasks = tmp;
+			group = anm_dynarr_size(es->tasks) - 1;
+			group_size = sz;
+		}
+		size += sz;
+		c = c->next;
+	}
 
-			anm_get_matrix(node->parent, parent_mat, tm);
-			cgm_mmul(cache->matrix, parent_mat);
+	if(size <= es->grain) {
+		/* the whole subtree fits in a task of the parent */
+		if(anm_dynarr_size(es->tasks) > ntasks) {
+			if(!(tmp = anm_dynarr_resize(es->tasks, ntasks))) {
+				es->err = 1;
+			} else {
+				es->tasks = tmp;
+			}
+		}
+	} else if(!es->err) {
+		if(!(tmp = anm_dynarr_push(es->upper, &node))) {
+			es->err = 1;
+		} else {
+			es->upper = tmp;
 		}
-		cache->time = tm;
 	}
+	return size;
+}
 
-	if(mat) {
-		cgm_mcopy(mat, cache->matrix);
+static void eval_task(void *cls, int idx)
+{
+	int i;
+	struct eval_split *es = cls;
+	struct anm_node *c = es->tasks[idx].first;
+
+	for(i=0; i<es->tasks[idx].count; i++) {
+		anm_eval(c, es->tm);
+		c = c->next;
 	}
-	return cache->matrix;
+}
+
+int anm_init_flat_tree(struct anm_flat_tree *ft, struct anm_node *tree)
+{
+	memset(ft, 0, sizeof *ft);
+	ft->root = tree;
+
+	if(!(ft->nodes = anm_dynarr_alloc(0, sizeof *ft->nodes)) ||
+			!(ft->parent = anm_dynarr_alloc(0, sizeof *ft->parent)) ||
+			!(ft->matrices = anm_dynarr_alloc(0, 16 * sizeof *ft->matrices)) ||
+			!(ft->cur = anm_dynarr_alloc(0, 3 * sizeof *ft->cur))) {
+		anm_destroy_flat_tree(ft);
+		return -1;
+	}
+	if(flatten(ft) == -1) {
+		anm_destroy_flat_tree(ft);
+		return -1;
+	}
+	return 0;
+}
+
+void anm_destroy_flat_tree(struct anm_flat_tree *ft)
+{
+	anm_dynarr_free(ft->nodes);
+	anm_dynarr_free(ft->parent);
+	anm_dynarr_free(ft->matrices);
+	anm_dynarr_free(ft->cur);
+}
+
+struct anm_flat_tree *anm_create_flat_tree(struct anm_node *tree)
+{
+	struct anm_flat_tree *ft;
+
+	if(!(ft = malloc(sizeof *ft))) {
+		return 0;
+	}
+	if(anm_init_flat_tree(ft, tree) == -1) {
+		free(ft);
+		return 0;
+	}
+	return ft;
+}
+
+void anm_free_flat_tree(struct anm_flat_tree *ft)
+{
+	anm_destroy_flat_tree(ft);
+	free(ft);
+}
+
+int anm_flat_tree_stale(const struct anm_flat_tree *ft)
+{
+	return ft->tree_rev != ft->root->tree_rev;
+}
+
+int anm_update_flat_tree(struct anm_flat_tree *ft)
+{
+	if(ft->tree_rev == ft->root->tree_rev) {
+		return 0;
+	}
+	return flatten(ft);
+}
+
+/* nodes are prefetched this far ahead of the one being evaluated */
+#define FLAT_PREFETCH_DIST	2
+
+int anm_eval_flat_tree(struct anm_flat_tree *ft, anm_time_t tm)
+{
+	int i;
+	float *mat;
+	struct anm_node *node;
+	struct anm_node_cursor *cur;
+
+	/* may reallocate the arrays */
+	if(anm_update_flat_tree(ft) == -1) {
+		return -1;
+	}
+	mat = ft->matrices;
+	cur = ft->cur;
+
+	for(i=0; i<ft->count; i++) {
+		if(i + FLAT_PREFETCH_DIST < ft->count) {
+			PREFETCH(ft->nodes[i + FLAT_PREFETCH_DIST]);
+		}
+		node = ft->nodes[i];
+
+		node_matrix(node, mat, tm, cur, cur + 1, cur + 2);
+
+		/* parents come first, so their matrix is already evaluated */
+		if(ft->parent[i] >= 0) {
+			cgm_mmul(mat, ft->matrices + ft->parent[i] * 16);
+		} else if(node->parent) {
+			cgm_mmul(mat, node->parent->matrix);
+		}
+
+		mat += 16;
+		cur += 3;
+	}
+	return 0;
+}
+
+int anm_find_flat_node(const struct anm_flat_tree *ft, const struct anm_node *node)
+{
+	int i;
+
+	for(i=0; i<ft->count; i++) {
+		if(ft->nodes[i] == node) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* (re)builds the node arrays of a flattened tree, and resets its cursors */
+static int flatten(struct anm_flat_tree *ft)
+{
+	int i;
+	void *tmp;
+
+	ft->count = 0;
+
+	if(!(tmp = anm_dynarr_resize(ft->nodes, 0))) {
+		return -1;
+	}
+	ft->nodes = tmp;
+	if(!(tmp = anm_dynarr_resize(ft->parent, 0))) {
+		return -1;
+	}
+	ft->parent = tmp;
+
+	if(flatten_tree(ft->root, -1, &ft->nodes, &ft->parent) == -1) {
+		return -1;
+	}
+
+	i = anm_dynarr_size(ft->nodes);
+	if(!(tmp = anm_dynarr_resize(ft->matrices, i))) {
+		return -1;
+	}
+	ft->matrices = tmp;
+	if(!(tmp = anm_dynarr_resize(ft->cur, i))) {
+		return -1;
+	}
+	ft->cur = tmp;
+	ft->count = i;
+
+	for(i=0; i<ft->count * 3; i++) {
+		init_node_cursor(ft->cur + i, 0);
+	}
+	ft->tree_rev = ft->root->tree_rev;
+	return 0;
+}
+
+float *anm_get_matrix(struct anm_node *node, float *mat, anm_time_t tm)
+{
+	struct anm_eval_context *ctx = thread_context();
+	assert(ctx);
+	return anm_get_matrix_context(node, mat, tm, ctx);
 }
 
 float *anm_get_inv_matrix(struct anm_node *node, float *mat, anm_time_t tm)
 {
-#ifdef ANIM_THREAD_SAFE
-	struct mat_cache *cache = pthread_getspecific(node->cache_key);
-	if(!cache) {
-		cache = malloc(sizeof *cache);
-		assert(cache);
+	struct anm_eval_context *ctx = thread_context();
+	assert(ctx);
+	return anm_get_inv_matrix_context(node, mat, tm, ctx);
+}
 
-		pthread_mutex_lock(&node->cache_list_lock);
-		cache->next = node->cache_list;
-		node->cache_list = cache;
-		pthread_mutex_unlock(&node->cache_list_lock);
+float *anm_get_matrix_context(struct anm_node *node, float *mat, anm_time_t tm,
+		struct anm_eval_context *ctx)
+{
+	struct anm_mat_cache *cache = get_cache(node, tm, ctx);
 
-		cache->inv_time = ANM_TIME_INVAL;
-		cache->inv_time = ANM_TIME_INVAL;
-		pthread_setspecific(node->cache_key, cache);
+	if(mat) {
+		cgm_mcopy(mat, cache->matrix);
 	}
-#else
-	struct mat_cache *cache = &node->cache;
-#endif
+	return cache->matrix;
+}
 
-	if(cache->inv_time != tm) {
-		anm_get_matrix(node, cache->inv_matrix, tm);
+float *anm_get_inv_matrix_context(struct anm_node *node, float *mat, anm_time_t tm,
+		struct anm_eval_context *ctx)
+{
+	struct anm_mat_cache *cache = get_cache(node, tm, ctx);
+
+	/* the inverse is valid if it was calculated from the current matrix */
+	if(!cache->stamp || cache->inv_stamp != cache->stamp) {
+		cgm_mcopy(cache->inv_matrix, cache->matrix);
 		cgm_minverse(cache->inv_matrix);
-		cache->inv_time = tm;
+		cache->inv_stamp = cache->stamp;
 	}
 
 	if(mat) {
@@ -934,24 +1451,228 @@ float *anm_get_inv_matrix(struct anm_node *node, float *mat, anm_time_t tm)
 	return cache->inv_matrix;
 }
 
+int anm_init_eval_context(struct anm_eval_context *ctx)
+{
+	memset(ctx, 0, sizeof *ctx);
+	return 0;
+}
+
+void anm_destroy_eval_context(struct anm_eval_context *ctx)
+{
+	free(ctx->cache);
+}
+
+struct anm_eval_context *anm_create_eval_context(void)
+{
+	struct anm_eval_context *ctx;
+
+	if(!(ctx = malloc(sizeof *ctx))) {
+		return 0;
+	}
+	if(anm_init_eval_context(ctx) == -1) {
+		free(ctx);
+		return 0;
+	}
+	return ctx;
+}
+
+void anm_free_eval_context(struct anm_eval_context *ctx)
+{
+	if(ctx) {
+		anm_destroy_eval_context(ctx);
+		free(ctx);
+	}
+}
+
+int anm_count_tree_nodes(const struct anm_node *tree)
+{
+	int count = 1;
+	const struct anm_node *c = tree->child;
+
+	while(c) {
+		count += anm_count_tree_nodes(c);
+		c = c->next;
+	}
+	return count;
+}
+
+int anm_bake_prs(struct anm_node *tree, anm_time_t start, anm_time_t period, int count, float *prs)
+{
+	return bake(tree, start, period, count, prs, 0);
+}
+
+int anm_bake_matrices(struct anm_node *tree, anm_time_t start, anm_time_t period, int count, float *mat)
+{
+	return bake(tree, start, period, count, 0, mat);
+}
+
+struct bake {
+	struct anm_node **nodes;
+	int *parent;		/* index of the parent of each node, -1 for the root */
+	int num_nodes;
+	anm_time_t start, period;
+	int count, chunk_size;
+	float *prs, *mat;	/* output, only one of them is used */
+	char *chunk_err;	/* set by each chunk which fails, combined afterwards */
+};
+
+static int bake(struct anm_node *tree, anm_time_t start, anm_time_t period, int count,
+		float *prs, float *mat)
+{
+	int i, nchunks, res = 0;
+	struct bake bk;
+
+	if(count <= 0) return 0;
+
+	bk.nodes = anm_dynarr_alloc(0, sizeof *bk.nodes);
+	bk.parent = anm_dynarr_alloc(0, sizeof *bk.parent);
+	if(!bk.nodes || !bk.parent || flatten_tree(tree, -1, &bk.nodes, &bk.parent) == -1) {
+		anm_dynarr_free(bk.nodes);
+		anm_dynarr_free(bk.parent);
+		return -1;
+	}
+	bk.num_nodes = anm_dynarr_size(bk.nodes);
+	bk.start = start;
+	bk.period = period;
+	bk.count = count;
+	bk.prs = prs;
+	bk.mat = mat;
+
+	/* The samples are split into a few chunks per thread, and each chunk is
+	 * evaluated in order. But evaluating a node in the middle of a transition
+	 * changes its state (see animation_time), so then all samples must be
+	 * evaluated in order, by a single thread.
+	 */
+	nchunks = anm_pool_size() * 4;
+	for(i=0; i<bk.num_nodes; i++) {
+		if(bk.nodes[i]->blend_dur >= 0) {
+			nchunks = 1;
+			break;
+		}
+	}
+	if(nchunks > count) nchunks = count;
+	bk.chunk_size = (count + nchunks - 1) / nchunks;
+	nchunks = (count + bk.chunk_size - 1) / bk.chunk_size;
+
+	/* chunks run concurrently, so each one reports failure in its own slot */
+	if(!(bk.chunk_err = calloc(nchunks, 1))) {
+		res = -1;
+	} else {
+		anm_pool_run(bake_chunk, &bk, nchunks);
+
+		for(i=0; i<nchunks; i++) {
+			if(bk.chunk_err[i]) {
+				res = -1;
+				break;
+			}
+		}
+		free(bk.chunk_err);
+	}
+
+	anm_dynarr_free(bk.nodes);
+	anm_dynarr_free(bk.parent);
+	return res;
+}
+
+static void bake_chunk(void *cls, int idx)
+{
+	int i, j, first, last;
+	anm_time_t tm;
+	float *out;
+	struct anm_node_cursor *nc;
+	struct bake *bk = cls;
+
+	first = idx * bk->chunk_size;
+	last = first + bk->chunk_size;
+	if(last > bk->count) last = bk->count;
+
+	/* each channel of each node gets its own cursors, so that the keyframe
+	 * intervals of each sample are found by stepping from the previous one.
+	 */
+	if(!(nc = malloc(bk->num_nodes * 3 * sizeof *nc))) {
+		bk->chunk_err[idx] = 1;
+		return;
+	}
+	for(i=0; i<bk->num_nodes * 3; i++) {
+		init_node_cursor(nc + i, 0);
+	}
+
+	for(i=first; i<last; i++) {
+		tm = bk->start + (anm_time_t)i * bk->period;
+
+		for(j=0; j<bk->num_nodes; j++) {
+			if(bk->prs) {
+				out = bk->prs + ((size_t)i * bk->num_nodes + j) * 10;
+				node_position(bk->nodes[j], out, tm, nc + j * 3);
+				node_rotation(bk->nodes[j], out + 3, tm, nc + j * 3 + 1);
+				node_scaling(bk->nodes[j], out + 7, tm, nc + j * 3 + 2);
+			} else {
+				out = bk->mat + ((size_t)i * bk->num_nodes + j) * 16;
+				node_matrix(bk->nodes[j], out, tm, nc + j * 3, nc + j * 3 + 1, nc + j * 3 + 2);
+				/* parents come first, so their world matrix is already done */
+				if(bk->parent[j] >= 0) {
+					cgm_mmul(out, bk->mat + ((size_t)i * bk->num_nodes + bk->parent[j]) * 16);
+				}
+			}
+		}
+	}
+	free(nc);
+}
+
+/* appends the nodes of a tree in depth-first order, along with the index of
+ * the parent of each one.
+ */
+static int flatten_tree(struct anm_node *node, int parent, struct anm_node ***nodes, int **parents)
+{
+	int idx;
+	void *tmp;
+	struct anm_node *c;
+
+	idx = anm_dynarr_size(*nodes);
+	if(!(tmp = anm_dynarr_push(*nodes, &node))) {
+		return -1;
+	}
+	*nodes = tmp;
+	if(!(tmp = anm_dynarr_push(*parents, &parent))) {
+		return -1;
+	}
+	*parents = tmp;
+
+	c = node->child;
+	while(c) {
+		if(flatten_tree(c, idx, nodes, parents) == -1) {
+			return -1;
+		}
+		c = c->next;
+	}
+	return 0;
+}
+
 anm_time_t anm_get_start_time(struct anm_node *node)
 {
 	int i, j;
 	struct anm_node *c;
+	struct anm_keyframe key;
 	anm_time_t res = LONG_MAX;
 
 	for(j=0; j<2; j++) {
 		struct anm_animation *anim = anm_get_active_animation(node, j);
 		if(!anim) break;
 
-		for(i=0; i<ANM_NUM_TRACKS; i++) {
-			if(anim->tracks[i].count) {
-				anm_time_t tm = anim->tracks[i].keys[0].time;
-				if(tm < res) {
-					res = tm;
-				}
+		for(i=0; anim->tracks && i<ANM_NUM_TRACKS; i++) {
+			if(anm_get_keyframe_copy(anim->tracks + i, 0, &key) != -1 && key.time < res) {
+				res = key.time;
 			}
 		}
+		if(anim->pos.count && anim->pos.times[0] < res) {
+			res = anim->pos.times[0];
+		}
+		if(anim->rot.count && anim->rot.times[0] < res) {
+			res = anim->rot.times[0];
+		}
+		if(anim->scl.count && anim->scl.times[0] < res) {
+			res = anim->scl.times[0];
+		}
 	}
 
 	c = node->child;
@@ -969,20 +1690,28 @@ anm_time_t anm_get_end_time(struct anm_node *node)
 {
 	int i, j;
 	struct anm_node *c;
+	struct anm_keyframe key;
 	anm_time_t res = LONG_MIN;
 
 	for(j=0; j<2; j++) {
 		struct anm_animation *anim = anm_get_active_animation(node, j);
 		if(!anim) break;
 
-		for(i=0; i<ANM_NUM_TRACKS; i++) {
-			if(anim->tracks[i].count) {
-				anm_time_t tm = anim->tracks[i].keys[anim->tracks[i].count - 1].time;
-				if(tm > res) {
-					res = tm;
-				}
+		for(i=0; anim->tracks && i<ANM_NUM_TRACKS; i++) {
+			if(anm_get_keyframe_copy(anim->tracks + i, anim->tracks[i].count - 1, &key) != -1 &&
+					key.time > res) {
+				res = key.time;
 			}
 		}
+		if(anim->pos.count && anim->pos.times[anim->pos.count - 1] > res) {
+			res = anim->pos.times[anim->pos.count - 1];
+		}
+		if(anim->rot.count && anim->rot.times[anim->rot.count - 1] > res) {
+			res = anim->rot.times[anim->rot.count - 1];
+		}
+		if(anim->scl.count && anim->scl.times[anim->scl.count - 1] > res) {
+			res = anim->scl.times[anim->scl.count - 1];
+		}
 	}
 
 	c = node->child;
@@ -996,22 +1725,281 @@ anm_time_t anm_get_end_time(struct anm_node *node)
 	return res;
 }
 
-static void invalidate_cache(struct anm_node *node)
+/* the structure of the subtree of node, and of all its ancestors, changed */
+static void tree_changed(struct anm_node *node)
 {
-	struct anm_node *c;
+	while(node) {
+		node->tree_rev++;
+		node = node->parent;
+	}
+}
+
+static int alloc_node_id(unsigned int *rev)
+{
+	int id, nfree;
+
+#ifdef ANIM_THREAD_SAFE
+	pthread_mutex_lock(&node_id_lock);
+#endif
+	if(!free_node_ids && !(free_node_ids = anm_dynarr_alloc(0, sizeof *free_node_ids))) {
+		id = -1;
+	} else if((nfree = anm_dynarr_size(free_node_ids)) > 0) {
+		id = free_node_ids[nfree - 1].id;
+		*rev = free_node_ids[nfree - 1].rev + 1;
+		free_node_ids = anm_dynarr_pop(free_node_ids);
+	} else {
+		id = next_node_id++;
+		*rev = 0;
+	}
+#ifdef ANIM_THREAD_SAFE
+	pthread_mutex_unlock(&node_id_lock);
+#endif
+	return id;
+}
+
+static void free_node_id(int id, unsigned int rev)
+{
+	struct free_id fid, *tmp;
+
+	if(id < 0) return;
+
+	fid.id = id;
+	fid.rev = rev;
+
+#ifdef ANIM_THREAD_SAFE
+	pthread_mutex_lock(&node_id_lock);
+#endif
+	/* if this fails, the id just won't be reused */
+	if((tmp = anm_dynarr_push(free_node_ids, &fid))) {
+		free_node_ids = tmp;
+	}
+#ifdef ANIM_THREAD_SAFE
+	pthread_mutex_unlock(&node_id_lock);
+#endif
+}
+
+static int grow_context(struct anm_eval_context *ctx, int id)
+{
+	int i, newsz;
+	struct anm_mat_cache *tmp;
+
+	newsz = ctx->size ? ctx->size * 2 : 32;
+	while(newsz <= id) newsz *= 2;
+
+	if(!(tmp = realloc(ctx->cache, newsz * sizeof *tmp))) {
+		return -1;
+	}
+	for(i=ctx->size; i<newsz; i++) {
+		tmp[i].time = ANM_TIME_INVAL;
+		tmp[i].stamp = tmp[i].inv_stamp = tmp[i].prs_stamp = 0;
+		tmp[i].checked = 0;
+	}
+	ctx->cache = tmp;
+	ctx->size = newsz;
+	return 0;
+}
+
+/* Returns the cache entry of a node in ctx, with an up to date matrix. If the
+ * cache can't grow to fit the node and its ancestors, the matrix is calculated
+ * in a temporary entry instead, which is never considered valid.
+ */
+static struct anm_mat_cache *get_cache(struct anm_node *node, anm_time_t tm,
+		struct anm_eval_context *ctx)
+{
+	struct anm_node *n;
+	float parent_mat[16];
+
+	if(!update_cache(node, tm, ctx)) {
+		anm_get_node_matrix(node, ctx->tmp.matrix, tm);
+		n = node->parent;
+		while(n) {
+			anm_get_node_matrix(n, parent_mat, tm);
+			cgm_mmul(ctx->tmp.matrix, parent_mat);
+			n = n->parent;
+		}
+		ctx->tmp.stamp = ctx->tmp.inv_stamp = ctx->tmp.prs_stamp = 0;
+		return &ctx->tmp;
+	}
+	return ctx->cache + node->id;
+}
+
+/* Brings the cached matrix of a node up to date, after doing the same for its
+ * parent, and returns its stamp, or 0 if the cache array can't grow to fit
+ * them. Every matrix calculated in a context gets a new stamp, and a cached
+ * matrix is current if it was calculated for the same time and revision of
+ * the node, from the current matrix of the parent.
+ * So a change to a node is picked up by all its descendants, in every
+ * context, without visiting them when the change is made.
+ * Checking the ancestors costs as much as the depth of the node, so entries
+ * also remember the edit count when they were last checked, and are trusted
+ * without checking again until the next change to any node.
+ */
+static unsigned int update_cache(struct anm_node *node, anm_time_t tm,
+		struct anm_eval_context *ctx)
+{
+	struct anm_mat_cache *cache;
+	unsigned int arev[2], pstamp = 0;
+
+	if(node->id >= ctx->size && grow_context(ctx, node->id) == -1) {
+		return 0;
+	}
+	cache = ctx->cache + node->id;
+
+	if(cache->stamp && cache->checked == edit_count && cache->time == tm) {
+		return cache->stamp;
+	}
+
+	if(node->parent) {
+		if(!(pstamp = update_cache(node->parent, tm, ctx))) {
+			return 0;
+		}
+		cache = ctx->cache + node->id;	/* the array might have moved */
+	}
+
+	anim_revs(node, arev);
+	if(!cache->stamp || cache->time != tm || cache->rev != node->rev ||
+			cache->anim_rev[0] != arev[0] || cache->anim_rev[1] != arev[1] ||
+			cache->parent_stamp != pstamp) {
+		anm_get_node_matrix(node, cache->matrix, tm);
+		if(node->parent) {
+			cgm_mmul(cache->matrix, ctx->cache[node->parent->id].matrix);
+		}
+		cache->time = tm;
+		cache->rev = node->rev;
+		cache->anim_rev[0] = arev[0];
+		cache->anim_rev[1] = arev[1];
+		cache->parent_stamp = pstamp;
+		if(!++ctx->stamp) ++ctx->stamp;
+		cache->stamp = ctx->stamp;
+	}
+	cache->checked = edit_count;
+	return cache->stamp;
+}
+
+/* Returns the cache entry of a node in ctx, with up to date world rotation and
+ * scaling, besides the matrix. If get_cache has to fall back to the temporary
+ * entry, they are calculated there without caching.
+ */
+static struct anm_mat_cache *get_prs_cache(struct anm_node *node, anm_time_t tm,
+		struct anm_eval_context *ctx)
+{
+	struct anm_mat_cache *cache = get_cache(node, tm, ctx);
+	struct anm_node *n;
+	cgm_quat q;
+	cgm_vec3 s;
+
+	if(cache->stamp) {
+		update_prs_cache(node, tm, ctx);
+		return cache;
+	}
+
+	anm_get_node_rotation(node, cache->rot, tm);
+	anm_get_node_scaling(node, cache->scale, tm);
+	n = node->parent;
+	while(n) {
+		anm_get_node_rotation(n, &q.x, tm);
+		cgm_qmul(&q, (cgm_quat*)cache->rot);
+		cache->rot[0] = q.x;
+		cache->rot[1] = q.y;
+		cache->rot[2] = q.z;
+		cache->rot[3] = q.w;
+
+		anm_get_node_scaling(n, &s.x, tm);
+		cgm_vmul((cgm_vec3*)cache->scale, &s);
+		n = n->parent;
+	}
+	return cache;
+}
+
+/* World rotation and scaling are calculated on demand, from those of the
+ * parent, and are current as long as the matrix of the entry is current,
+ * which get_cache has already made sure of for the whole chain of ancestors.
+ */
+static void update_prs_cache(struct anm_node *node, anm_time_t tm,
+		struct anm_eval_context *ctx)
+{
+	struct anm_mat_cache *cache = ctx->cache + node->id;
+	struct anm_mat_cache *pcache;
+	cgm_quat q;
+
+	if(cache->prs_stamp == cache->stamp) {
+		return;
+	}
+
+	anm_get_node_rotation(node, cache->rot, tm);
+	anm_get_node_scaling(node, cache->scale, tm);
+
+	if(node->parent) {
+		update_prs_cache(node->parent, tm, ctx);
+		pcache = ctx->cache + node->parent->id;
+
+		q.x = pcache->rot[0];
+		q.y = pcache->rot[1];
+		q.z = pcache->rot[2];
+		q.w = pcache->rot[3];
+		cgm_qmul(&q, (cgm_quat*)cache->rot);
+		cache->rot[0] = q.x;
+		cache->rot[1] = q.y;
+		cache->rot[2] = q.z;
+		cache->rot[3] = q.w;
+
+		cgm_vmul((cgm_vec3*)cache->scale, (cgm_vec3*)pcache->scale);
+	}
+	cache->prs_stamp = cache->stamp;
+}
 
 #ifdef ANIM_THREAD_SAFE
-	struct mat_cache *cache = pthread_getspecific(node->cache_key);
-	if(cache) {
-	   cache->time = cache->inv_time = ANM_TIME_INVAL;
+static void free_thread_context(void *ctx)
+{
+	anm_free_eval_context(ctx);
+}
+
+static void create_ctx_key(void)
+{
+	pthread_key_create(&ctx_key, free_thread_context);
+}
+
+static struct anm_eval_context *thread_context(void)
+{
+	struct anm_eval_context *ctx;
+
+	pthread_once(&ctx_key_once, create_ctx_key);
+
+	if(!(ctx = pthread_getspecific(ctx_key))) {
+		if(!(ctx = anm_create_eval_context())) {
+			return 0;
+		}
+		pthread_setspecific(ctx_key, ctx);
 	}
+	return ctx;
+}
 #else
-	node->cache.time = node->cache.inv_time = ANM_TIME_INVAL;
+static struct anm_eval_context *thread_context(void)
+{
+	return &def_ctx;
+}
 #endif
 
-	c = node->child;
-	while(c) {
-		invalidate_cache(c);
-		c = c->next;
+/* Bumps the revision of the node, which invalidates its cached matrices and
+ * those of its descendants in all evaluation contexts, the next time they are
+ * requested (see update_cache).
+ */
+static void invalidate_cache(struct anm_node *node)
+{
+	node->rev++;
+	edit_count++;
+}
+
+/* Revisions of the current animations of the node. A change of the current
+ * animations increments the revision of the node itself, so these only need
+ * to catch changes made through the animations (see anm_simplify_animation).
+ */
+static void anim_revs(const struct anm_node *node, unsigned int *arev)
+{
+	int i, aidx, num_anim = anm_dynarr_size(node->animations);
+
+	for(i=0; i<2; i++) {
+		aidx = node->cur_anim[i];
+		arev[i] = aidx >= 0 && aidx < num_anim ? node->animations[aidx].rev : 0;
 	}
 }
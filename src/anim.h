@@ -49,7 +49,31 @@ enum {
 
 struct anm_animation {
 	char *name;
-	struct anm_track tracks[ANM_NUM_TRACKS];
+	/* legacy per-component tracks, null until requested with
+	 * anm_get_animation_track. They are only used for a channel if keyframes
+	 * are added to them directly, and the corresponding track below is empty.
+	 *
+	 * Migration note: up to ABI version 1 this was an embedded array of
+	 * ANM_NUM_TRACKS tracks, which anm_set_position/rotation/scaling wrote to.
+	 * Code indexing anim->tracks directly must call
+	 * anm_get_animation_track(anim, ANM_TRACK_*) instead, since the array may
+	 * not exist. Keyframes set with the anm_set_* functions are no longer in
+	 * these tracks, but in the pos, rot and scl channels below; read them with
+	 * anm_get_vec3_keyframe and anm_get_quat_keyframe (see track.h).
+	 */
+	struct anm_track *tracks;
+	/* keyframes set with anm_set_position/rotation/scaling. Channels without
+	 * keyframes don't allocate any memory and evaluate to their defaults.
+	 */
+	struct anm_vec3_track pos;
+	struct anm_quat_track rot;
+	struct anm_vec3_track scl;
+
+	/* key times shared by the channels above, see anm_share_animation_times */
+	anm_time_t *times;
+
+	/* incremented by anm_simplify_animation, checked by the matrix caches */
+	unsigned int rev;
 };
 
 struct anm_node {
@@ -65,18 +89,12 @@ struct anm_node {
 	struct anm_animation *animations;
 	float pivot[3];
 
-	/* matrix cache */
-	struct mat_cache {
-		float matrix[16], inv_matrix[16];
-		anm_time_t time, inv_time;
-		struct mat_cache *next;
-#ifdef ANIM_THREAD_SAFE
-	} *cache_list;
-	pthread_key_t cache_key;
-	pthread_mutex_t cache_list_lock;
-#else
-	} cache;
-#endif
+	/* dense node id, indexing the matrix caches of evaluation contexts. Ids are
+	 * unique among live nodes, and reused after a node is destroyed.
+	 */
+	int id;
+	/* revision, incremented by every change which affects the node's matrix */
+	unsigned int rev;
 
 	/* matrix calculated by anm_eval functions (no locking, meant as a pre-pass) */
 	float matrix[16];
@@ -84,10 +102,66 @@ struct anm_node {
 	struct anm_node *parent;
 	struct anm_node *child;
 	struct anm_node *next;
+	/* incremented whenever nodes are linked or unlinked anywhere in the subtree */
+	unsigned int tree_rev;
 
 	void *data;	/* user data pointer */
 };
 
+/* matrices of a node cached by anm_get_matrix and anm_get_inv_matrix, and
+ * world rotation and scaling cached by anm_get_rotation and anm_get_scaling
+ */
+struct anm_mat_cache {
+	float matrix[16], inv_matrix[16];
+	float rot[4], scale[3];
+	anm_time_t time;
+	unsigned int rev;			/* revision of the node they were calculated for */
+	unsigned int anim_rev[2];	/* revisions of its current animations */
+	unsigned int stamp;			/* unique in the context, 0 if invalid */
+	unsigned int parent_stamp;	/* stamp of the parent matrix used */
+	unsigned int inv_stamp;		/* stamp of the matrix that was inverted */
+	unsigned int prs_stamp;		/* stamp of the matrix when rot/scale were calculated */
+	unsigned int checked;		/* edit count when last found to be current */
+};
+
+/* An evaluation context holds the matrix caches of the bottom-up lazy matrix
+ * calculation interface, for any number of nodes, in a single array indexed
+ * by node id, which grows as needed. A context must only be used by one
+ * thread at a time, and without locking.
+ * Each thread has a default context, used by anm_get_matrix and
+ * anm_get_inv_matrix. Threads can also own explicit contexts, and use them
+ * with the _context variants of those functions.
+ */
+struct anm_eval_context {
+	int size;
+	unsigned int stamp;		/* last stamp given to a cached matrix */
+	struct anm_mat_cache *cache;
+	struct anm_mat_cache tmp;	/* used if growing the cache array fails */
+};
+
+struct anm_node_cursor;
+
+/* A flattened node tree keeps the nodes of a tree in an array, in depth-first
+ * order, so that each node comes after its parent. The tree is evaluated by a
+ * single pass over the array, instead of a recursive traversal, and the
+ * resulting matrices are written to another contiguous array. Each node also
+ * gets its own keyframe lookup cursors, which are kept from one evaluation to
+ * the next, so that during playback keyframes are found by stepping from the
+ * previous frame's.
+ * The flattened tree is rebuilt automatically if nodes are linked or unlinked
+ * anywhere in the tree (see tree_rev).
+ */
+struct anm_flat_tree {
+	struct anm_node *root;
+	unsigned int tree_rev;		/* tree_rev of the root when the tree was flattened */
+
+	int count;
+	struct anm_node **nodes;
+	int *parent;				/* index of the parent of each node, -1 for the root */
+	float *matrices;			/* 16 floats per node, see anm_eval_flat_tree */
+	struct anm_node_cursor *cur;	/* 3 per node, one for each channel */
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -97,6 +171,33 @@ void anm_destroy_animation(struct anm_animation *anim);
 
 void anm_set_animation_name(struct anm_animation *anim, const char *name);
 
+/* Returns one of the legacy per-component tracks of the animation (idx is one
+ * of the ANM_TRACK_* enums), allocating all of them on the first call.
+ * Returns null on failure.
+ */
+struct anm_track *anm_get_animation_track(struct anm_animation *anim, int idx);
+
+/* Makes the position, rotation and scaling channels of the animation share a
+ * single array of key times, if all channels with keyframes have the same key
+ * times. This is typically the case for exported animations, which key all
+ * channels on the same frames. Besides saving memory, it allows evaluating a
+ * node matrix with a single keyframe search for all channels.
+ * Adding a keyframe at a new time to a channel later on gives it back its own
+ * copy of the key times, so this is best done once all keyframes are set (and
+ * after anm_simplify_animation, which removes different keys from each
+ * channel).
+ * Returns -1 if the channels have different key times, or on failure.
+ */
+int anm_share_animation_times(struct anm_animation *anim);
+
+/* Removes redundant keyframes from all the PRS tracks of the animation, see
+ * anm_simplify_tracks and anm_simplify_quat. Position and scaling errors are
+ * distances, the rotation error is an angle in radians. Cached matrices of
+ * the node using the animation are invalidated.
+ * Returns the total number of keyframes removed, or -1 on failure.
+ */
+int anm_simplify_animation(struct anm_animation *anim, float pos_err, float rot_err, float scl_err);
+
 
 /* ---- node/hierarchy management ---- */
 
@@ -209,11 +310,22 @@ void anm_set_scaling(struct anm_node *node, const float *scale, anm_time_t tm);
 void anm_set_scaling3f(struct anm_node *node, float x, float y, float z, anm_time_t tm);
 void anm_get_node_scaling(struct anm_node *node, float *scale, anm_time_t tm);
 
-/* these three return the full p/r/s taking hierarchy into account */
+/* These three return the full p/r/s taking hierarchy into account. They are
+ * cached along with the matrices, in the default evaluation context of the
+ * calling thread (see anm_get_matrix).
+ */
 void anm_get_position(struct anm_node *node, float *pos, anm_time_t tm);
 void anm_get_rotation(struct anm_node *node, float *qrot, anm_time_t tm);
 void anm_get_scaling(struct anm_node *node, float *scale, anm_time_t tm);
 
+/* same as above, caching in an explicit evaluation context */
+void anm_get_position_context(struct anm_node *node, float *pos, anm_time_t tm,
+		struct anm_eval_context *ctx);
+void anm_get_rotation_context(struct anm_node *node, float *qrot, anm_time_t tm,
+		struct anm_eval_context *ctx);
+void anm_get_scaling_context(struct anm_node *node, float *scale, anm_time_t tm,
+		struct anm_eval_context *ctx);
+
 /* those return the start and end times of the whole tree */
 anm_time_t anm_get_start_time(struct anm_node *node);
 anm_time_t anm_get_end_time(struct anm_node *node);
@@ -231,13 +343,53 @@ void anm_get_node_inv_matrix(struct anm_node *node, float *mat, anm_time_t tm);
 void anm_eval_node(struct anm_node *node, anm_time_t tm);
 /* calculate and set the matrix of this node and all its children recursively */
 void anm_eval(struct anm_node *node, anm_time_t tm);
+/* Same as anm_eval, but independent subtrees are evaluated in parallel, by
+ * multiple threads (see anm_set_thread_count). The tree is split into tasks
+ * of whole subtrees, with up to grain nodes each (0 for the default). The
+ * nodes above them, which have too many descendants to fit in a single
+ * task, are evaluated first by the calling thread.
+ * Results are identical to anm_eval.
+ */
+void anm_eval_parallel(struct anm_node *node, anm_time_t tm, int grain);
+
+
+/* ---- flattened trees ---- */
+
+/* flattened tree constructor and destructor, tree is the root node */
+int anm_init_flat_tree(struct anm_flat_tree *ft, struct anm_node *tree);
+void anm_destroy_flat_tree(struct anm_flat_tree *ft);
+
+/* helper functions that use anm_init_flat_tree and anm_destroy_flat_tree internally */
+struct anm_flat_tree *anm_create_flat_tree(struct anm_node *tree);
+void anm_free_flat_tree(struct anm_flat_tree *ft);
+
+/* returns non-zero if nodes were linked or unlinked in the tree since it was
+ * flattened. Destroying nodes of the tree without unlinking them first is not
+ * detected.
+ */
+int anm_flat_tree_stale(const struct anm_flat_tree *ft);
+/* Flattens the tree again if it's stale, which is done automatically by
+ * anm_eval_flat_tree. Returns -1 on failure.
+ */
+int anm_update_flat_tree(struct anm_flat_tree *ft);
+
+/* Same as anm_eval, but the matrices are written to ft->matrices, in the
+ * order of ft->nodes, and the matrix of each node is not modified. If the
+ * root has a parent, its matrix is used as the parent matrix of the root.
+ * Returns -1 if the tree is stale and flattening it again failed.
+ */
+int anm_eval_flat_tree(struct anm_flat_tree *ft, anm_time_t tm);
+
+/* returns the index of node in the flattened tree, or -1 */
+int anm_find_flat_node(const struct anm_flat_tree *ft, const struct anm_node *node);
 
 
 /* ---- bottom-up lazy matrix calculation interface ---- */
 
 /* These calculate the matrix and inverse matrix of this node taking hierarchy
- * into account. The results are cached in thread-specific storage and returned
- * if there's no change in time or tracks from the last query...
+ * into account. The results are cached in the default evaluation context of
+ * the calling thread, and returned if there's no change in time or tracks
+ * from the last query...
  *
  * A pointer to the internal cached matrix is returned, and also if mat is not
  * null, the matrix is copied there.
@@ -245,6 +397,62 @@ void anm_eval(struct anm_node *node, anm_time_t tm);
 float *anm_get_matrix(struct anm_node *node, float *mat, anm_time_t tm);
 float *anm_get_inv_matrix(struct anm_node *node, float *mat, anm_time_t tm);
 
+/* same as above, caching the matrices in an explicit evaluation context */
+float *anm_get_matrix_context(struct anm_node *node, float *mat, anm_time_t tm,
+		struct anm_eval_context *ctx);
+float *anm_get_inv_matrix_context(struct anm_node *node, float *mat, anm_time_t tm,
+		struct anm_eval_context *ctx);
+
+/* evaluation context constructor and destructor */
+int anm_init_eval_context(struct anm_eval_context *ctx);
+void anm_destroy_eval_context(struct anm_eval_context *ctx);
+
+/* helper functions that use anm_init_eval_context and anm_destroy_eval_context internally */
+struct anm_eval_context *anm_create_eval_context(void);
+void anm_free_eval_context(struct anm_eval_context *ctx);
+
+
+/* ---- baking ---- */
+
+/* returns the number of nodes in a tree */
+int anm_count_tree_nodes(const struct anm_node *tree);
+
+/* These evaluate a tree at count different times, every period time units
+ * starting at start, and write the results of all nodes for each time, in
+ * depth-first order (starting with tree), to an array provided by the
+ * caller. Samples are split across multiple threads (see
+ * anm_set_thread_count), and the keyframes of every track are found by
+ * stepping from one sample to the next.
+ * The tree must not be modified while it's being baked. If any node is in
+ * the middle of an animation transition (see anm_transition), all samples
+ * are evaluated by the calling thread, in order.
+ * Both return -1 on failure.
+ */
+
+/* Writes the local position (3 floats), rotation quaternion (4 floats), and
+ * scaling (3 floats) of each node, as returned by the anm_get_node_* functions.
+ * The prs array must have room for count * anm_count_tree_nodes(tree) * 10
+ * floats.
+ */
+int anm_bake_prs(struct anm_node *tree, anm_time_t start, anm_time_t period, int count, float *prs);
+/* Writes the matrix of each node taking the hierarchy into account, same as
+ * the one calculated by anm_eval. The mat array must have room for
+ * count * anm_count_tree_nodes(tree) * 16 floats.
+ */
+int anm_bake_matrices(struct anm_node *tree, anm_time_t start, anm_time_t period, int count, float *mat);
+
+
+/* ---- multi-threading ---- */
+
+/* Sets the number of threads used by functions which split their work across
+ * multiple threads, including the calling thread. 0 (the default) means one
+ * per processor, and 1 disables multi-threading. Threads are only used if
+ * libanim is built with thread safety (ANIM_THREAD_SAFE), otherwise
+ * everything runs on the calling thread regardless.
+ */
+void anm_set_thread_count(int n);
+int anm_get_thread_count(void);
+
 #ifdef __cplusplus
 }
 #endif
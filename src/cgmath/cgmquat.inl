@@ -137,7 +137,7 @@ static inline void cgm_qslerp(cgm_quat *res, const cgm_quat *quat1, const cgm_qu
 	sin_angle = sin(angle);
 	if(sin_angle == 0.0f) {
 		/* use linear interpolation to avoid div/zero */
-		a = 1.0f;
+		a = 1.0f - t;
 		b = t;
 	} else {
 		a = sin((1.0f - t) * angle) / sin_angle;
@@ -0,0 +1,727 @@
+/*
+libanim - hierarchical keyframe animation library
+Copyright (C) 2012-2023 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "frozen.h"
+#include "dynarr.h"
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "cgmath/cgmath.h"
+
+#define FROZEN_VERSION	1
+#define BYTE_ORDER_MARK	0x01020304
+
+/* alignment of every array in the block, for SIMD access to the keyframes */
+#define FROZEN_ALIGN	16
+
+/* All the structures below are stored in the block. Every unsigned int which
+ * refers to something else in the block is a byte offset from its start, and
+ * 0 stands for null, since the header is always at offset 0.
+ */
+struct anm_frozen {
+	char magic[4];				/* "ANMF" */
+	unsigned int byte_order;	/* BYTE_ORDER_MARK in native byte order */
+	int version;
+	int time_size;				/* sizeof(anm_time_t) */
+	unsigned int size;
+	int num_nodes, num_anims;
+	unsigned int nodes;			/* struct frozen_node array */
+	unsigned int anims;			/* struct frozen_anim array */
+};
+
+struct frozen_node {
+	unsigned int name;
+	int first_anim, num_anims;
+	float pivot[3];
+};
+
+enum { CHAN_POS, CHAN_ROT, CHAN_SCL, NUM_CHAN };
+
+struct frozen_chan {
+	int count;
+	int interp, extrap;
+	unsigned int times;		/* anm_time_t array, shared by channels with the same key times */
+	unsigned int keys;		/* struct anm_vec3_key or anm_quat_key array */
+	float def_val[4];
+};
+
+struct frozen_anim {
+	unsigned int name;
+	struct frozen_chan chan[NUM_CHAN];
+};
+
+/* keyframes of a channel, to be copied to the block */
+struct chan_src {
+	int count;
+	const anm_time_t *times;
+	const void *keys;
+	size_t keysz;
+	const float *def_val;
+	int ndef;
+	enum anm_interpolator interp;
+	enum anm_extrapolator extrap;
+};
+
+/* The block is laid out twice, first without a buffer, to calculate its
+ * size, and then again, writing everything in the allocated buffer.
+ */
+struct freezer {
+	char *buf;
+	size_t size;
+};
+
+#define FZ_PTR(fz, offs)	((const char*)(fz) + (offs))
+
+static struct anm_frozen *freeze(const struct anm_node **nodes, int num_nodes,
+		const struct anm_animation *anim);
+static int freeze_anim(struct freezer *fr, size_t offs, const struct anm_animation *anim);
+static size_t put(struct freezer *fr, const void *data, size_t size, size_t align);
+static size_t put_str(struct freezer *fr, const char *str);
+static void vec3_src(struct chan_src *src, const struct anm_vec3_track *trk);
+static void quat_src(struct chan_src *src, const struct anm_quat_track *trk);
+static int legacy_vec3(struct anm_vec3_track *res, const struct anm_track *trk);
+static int legacy_quat(struct anm_quat_track *res, const struct anm_track *trk);
+static void get_nodes(const struct anm_node *node, const struct anm_node ***nodes);
+static int check_str(const struct anm_frozen *fz, unsigned int offs);
+static int check_array(const struct anm_frozen *fz, unsigned int offs, int count, size_t szelem);
+static const struct frozen_node *get_node(const struct anm_frozen *fz, int node);
+static const struct frozen_anim *get_anim(const struct anm_frozen *fz, int node, int anim);
+static void vec3_view(struct anm_vec3_track *trk, const struct anm_frozen *fz,
+		const struct frozen_chan *ch);
+static void quat_view(struct anm_quat_track *trk, const struct anm_frozen *fz,
+		const struct frozen_chan *ch);
+static size_t page_size(void);
+static void *alloc_pages(size_t size);
+static void free_pages(void *ptr);
+
+struct anm_frozen *anm_freeze_animation(const struct anm_animation *anim)
+{
+	return freeze(0, 1, anim);
+}
+
+struct anm_frozen *anm_freeze_node_tree(const struct anm_node *tree)
+{
+	const struct anm_node **nodes;
+	struct anm_frozen *fz;
+
+	if(!(nodes = anm_dynarr_alloc(0, sizeof *nodes))) {
+		return 0;
+	}
+	get_nodes(tree, &nodes);
+	if(!nodes) {
+		return 0;
+	}
+
+	fz = freeze(nodes, anm_dynarr_size(nodes), 0);
+	anm_dynarr_free(nodes);
+	return fz;
+}
+
+void anm_free_frozen(struct anm_frozen *fz)
+{
+	free_pages(fz);
+}
+
+const struct anm_frozen *anm_frozen_from_data(const void *data, size_t size)
+{
+	int i, j;
+	const struct anm_frozen *fz = data;
+	const struct frozen_node *fnode;
+	const struct frozen_anim *fanim;
+	const struct frozen_chan *ch;
+
+	if(!data || ((size_t)data & (FROZEN_ALIGN - 1)) || size < sizeof *fz) {
+		return 0;
+	}
+	if(memcmp(fz->magic, "ANMF", 4) != 0 || fz->byte_order != BYTE_ORDER_MARK ||
+			fz->version != FROZEN_VERSION || fz->time_size != sizeof(anm_time_t) ||
+			fz->size > size) {
+		return 0;
+	}
+
+	/* make sure nothing points outside the block, so that it's safe to use */
+	if(!check_array(fz, fz->nodes, fz->num_nodes, sizeof *fnode) ||
+			!check_array(fz, fz->anims, fz->num_anims, sizeof *fanim)) {
+		return 0;
+	}
+	fnode = (const struct frozen_node*)FZ_PTR(fz, fz->nodes);
+	for(i=0; i<fz->num_nodes; i++) {
+		if(!check_str(fz, fnode[i].name) || fnode[i].first_anim < 0 || fnode[i].num_anims < 0 ||
+				fnode[i].num_anims > fz->num_anims - fnode[i].first_anim) {
+			return 0;
+		}
+	}
+	fanim = (const struct frozen_anim*)FZ_PTR(fz, fz->anims);
+	for(i=0; i<fz->num_anims; i++) {
+		if(!check_str(fz, fanim[i].name)) {
+			return 0;
+		}
+		for(j=0; j<NUM_CHAN; j++) {
+			ch = fanim[i].chan + j;
+			if((unsigned int)ch->interp > ANM_INTERP_CUBIC ||
+					(unsigned int)ch->extrap > ANM_EXTRAP_PINGPONG) {
+				return 0;
+			}
+			if(!check_array(fz, ch->times, ch->count, sizeof(anm_time_t)) ||
+					!check_array(fz, ch->keys, ch->count, j == CHAN_ROT ?
+						sizeof(struct anm_quat_key) : sizeof(struct anm_vec3_key))) {
+				return 0;
+			}
+		}
+	}
+	return fz;
+}
+
+size_t anm_get_frozen_size(const struct anm_frozen *fz)
+{
+	return fz->size;
+}
+
+int anm_get_frozen_node_count(const struct anm_frozen *fz)
+{
+	return fz->num_nodes;
+}
+
+const char *anm_get_frozen_node_name(const struct anm_frozen *fz, int node)
+{
+	const struct frozen_node *fnode = get_node(fz, node);
+	return fnode && fnode->name ? FZ_PTR(fz, fnode->name) : 0;
+}
+
+int anm_find_frozen_node(const struct anm_frozen *fz, const char *name)
+{
+	int i;
+	const struct frozen_node *fnode = (const struct frozen_node*)FZ_PTR(fz, fz->nodes);
+
+	for(i=0; i<fz->num_nodes; i++) {
+		if(fnode[i].name && strcmp(FZ_PTR(fz, fnode[i].name), name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+int anm_get_frozen_animation_count(const struct anm_frozen *fz, int node)
+{
+	const struct frozen_node *fnode = get_node(fz, node);
+	return fnode ? fnode->num_anims : 0;
+}
+
+const char *anm_get_frozen_animation_name(const struct anm_frozen *fz, int node, int anim)
+{
+	const struct frozen_anim *fanim = get_anim(fz, node, anim);
+	return fanim && fanim->name ? FZ_PTR(fz, fanim->name) : 0;
+}
+
+int anm_find_frozen_animation(const struct anm_frozen *fz, int node, const char *name)
+{
+	int i;
+	const struct frozen_anim *fanim;
+	const struct frozen_node *fnode = get_node(fz, node);
+
+	if(!fnode) return -1;
+
+	fanim = (const struct frozen_anim*)FZ_PTR(fz, fz->anims) + fnode->first_anim;
+	for(i=0; i<fnode->num_anims; i++) {
+		if(fanim[i].name && strcmp(FZ_PTR(fz, fanim[i].name), name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+void anm_get_frozen_position(const struct anm_frozen *fz, int node, int anim,
+		anm_time_t tm, float *pos)
+{
+	struct anm_vec3_track trk;
+	const struct frozen_anim *fanim = get_anim(fz, node, anim);
+
+	if(!fanim) {
+		pos[0] = pos[1] = pos[2] = 0.0f;
+		return;
+	}
+	vec3_view(&trk, fz, fanim->chan + CHAN_POS);
+	anm_get_vec3_value(&trk, tm, pos);
+}
+
+void anm_get_frozen_rotation(const struct anm_frozen *fz, int node, int anim,
+		anm_time_t tm, float *qrot)
+{
+	struct anm_quat_track trk;
+	const struct frozen_anim *fanim = get_anim(fz, node, anim);
+
+	if(!fanim) {
+		qrot[0] = qrot[1] = qrot[2] = 0.0f;
+		qrot[3] = 1.0f;
+		return;
+	}
+	quat_view(&trk, fz, fanim->chan + CHAN_ROT);
+	anm_get_quat_value(&trk, tm, qrot);
+}
+
+void anm_get_frozen_scaling(const struct anm_frozen *fz, int node, int anim,
+		anm_time_t tm, float *scale)
+{
+	struct anm_vec3_track trk;
+	const struct frozen_anim *fanim = get_anim(fz, node, anim);
+
+	if(!fanim) {
+		scale[0] = scale[1] = scale[2] = 1.0f;
+		return;
+	}
+	vec3_view(&trk, fz, fanim->chan + CHAN_SCL);
+	anm_get_vec3_value(&trk, tm, scale);
+}
+
+void anm_get_frozen_matrix(const struct anm_frozen *fz, int node, int anim,
+		anm_time_t tm, float *mat)
+{
+	int i;
+	float rmat[16];
+	cgm_vec3 pos, scale;
+	cgm_quat rot;
+	struct anm_vec3_track vtrk;
+	struct anm_quat_track qtrk;
+	struct anm_cursor cur, *rcur, *scur;
+	const struct frozen_anim *fanim = get_anim(fz, node, anim);
+	const struct frozen_node *fnode = get_node(fz, node);
+
+	if(!fanim) {
+		/* default position, rotation and scaling, the pivot cancels out */
+		cgm_midentity(mat);
+		return;
+	}
+
+	/* channels with the same key times share a single lookup cursor, so the
+	 * keyframe interval is only searched for once.
+	 */
+	anm_init_cursor(&cur);
+	rcur = fanim->chan[CHAN_ROT].times == fanim->chan[CHAN_POS].times ? &cur : 0;
+	scur = fanim->chan[CHAN_SCL].times == fanim->chan[CHAN_POS].times ? &cur : 0;
+
+	vec3_view(&vtrk, fz, fanim->chan + CHAN_POS);
+	anm_get_vec3_value_cursor(&vtrk, tm, &pos.x, &cur);
+
+	quat_view(&qtrk, fz, fanim->chan + CHAN_ROT);
+	if(rcur) {
+		anm_get_quat_value_cursor(&qtrk, tm, &rot.x, rcur);
+	} else {
+		anm_get_quat_value(&qtrk, tm, &rot.x);
+	}
+
+	vec3_view(&vtrk, fz, fanim->chan + CHAN_SCL);
+	if(scur) {
+		anm_get_vec3_value_cursor(&vtrk, tm, &scale.x, scur);
+	} else {
+		anm_get_vec3_value(&vtrk, tm, &scale.x);
+	}
+
+	cgm_mtranslation(mat, fnode->pivot[0], fnode->pivot[1], fnode->pivot[2]);
+	cgm_mrotation_quat(rmat, &rot);
+
+	for(i=0; i<3; i++) {
+		mat[i] = rmat[i];
+		mat[4 + i] = rmat[4 + i];
+		mat[8 + i] = rmat[8 + i];
+	}
+
+	mat[0] *= scale.x; mat[4] *= scale.y; mat[8] *= scale.z; mat[12] += pos.x;
+	mat[1] *= scale.x; mat[5] *= scale.y; mat[9] *= scale.z; mat[13] += pos.y;
+	mat[2] *= scale.x; mat[6] *= scale.y; mat[10] *= scale.z; mat[14] += pos.z;
+
+	cgm_mpretranslate(mat, -fnode->pivot[0], -fnode->pivot[1], -fnode->pivot[2]);
+}
+
+/* Lays out the whole block, with either the nodes of a tree, or a single
+ * unnamed node with a single animation if nodes is null.
+ */
+static struct anm_frozen *freeze(const struct anm_node **nodes, int num_nodes,
+		const struct anm_animation *anim)
+{
+	int i, j, pass, num_anims, nanim;
+	size_t hdr_offs, node_offs, anim_offs, pgsz, size = 0;
+	struct freezer fr;
+	struct anm_frozen hdr;
+	struct frozen_node fnode;
+
+	num_anims = 0;
+	for(i=0; i<num_nodes; i++) {
+		num_anims += nodes ? anm_get_animation_count(nodes[i]) : 1;
+	}
+
+	fr.buf = 0;
+	for(pass=0; pass<2; pass++) {
+		fr.size = 0;
+		hdr_offs = put(&fr, 0, sizeof hdr, FROZEN_ALIGN);
+		node_offs = put(&fr, 0, num_nodes * sizeof fnode, FROZEN_ALIGN);
+		anim_offs = put(&fr, 0, num_anims * sizeof(struct frozen_anim), FROZEN_ALIGN);
+
+		nanim = 0;
+		for(i=0; i<num_nodes; i++) {
+			memset(&fnode, 0, sizeof fnode);
+			fnode.first_anim = nanim;
+
+			if(nodes) {
+				fnode.name = put_str(&fr, nodes[i]->name);
+				fnode.num_anims = anm_get_animation_count(nodes[i]);
+				memcpy(fnode.pivot, nodes[i]->pivot, sizeof fnode.pivot);
+
+				for(j=0; j<fnode.num_anims; j++) {
+					if(freeze_anim(&fr, anim_offs + nanim++ * sizeof(struct frozen_anim),
+								nodes[i]->animations + j) == -1) {
+						goto err;
+					}
+				}
+			} else {
+				fnode.num_anims = 1;
+				if(freeze_anim(&fr, anim_offs + nanim++ * sizeof(struct frozen_anim), anim) == -1) {
+					goto err;
+				}
+			}
+			if(fr.buf) {
+				memcpy(fr.buf + node_offs + i * sizeof fnode, &fnode, sizeof fnode);
+			}
+		}
+
+		if(!fr.buf) {
+			/* round the size up to whole pages, so it can be mapped as is */
+			pgsz = page_size();
+			size = (fr.size + pgsz - 1) / pgsz * pgsz;
+			if(size > UINT_MAX || !(fr.buf = alloc_pages(size))) {
+				return 0;
+			}
+			memset(fr.buf, 0, size);
+		}
+	}
+
+	memcpy(hdr.magic, "ANMF", 4);
+	hdr.byte_order = BYTE_ORDER_MARK;
+	hdr.version = FROZEN_VERSION;
+	hdr.time_size = sizeof(anm_time_t);
+	hdr.size = (unsigned int)size;
+	hdr.num_nodes = num_nodes;
+	hdr.num_anims = num_anims;
+	hdr.nodes = (unsigned int)node_offs;
+	hdr.anims = (unsigned int)anim_offs;
+	memcpy(fr.buf + hdr_offs, &hdr, sizeof hdr);
+	return (struct anm_frozen*)fr.buf;
+
+err:
+	free_pages(fr.buf);
+	return 0;
+}
+
+/* writes the keyframes of an animation, and its entry in the animation table at offs */
+static int freeze_anim(struct freezer *fr, size_t offs, const struct anm_animation *anim)
+{
+	int i, j, res = -1;
+	struct frozen_anim fanim;
+	struct frozen_chan *ch;
+	struct chan_src src[NUM_CHAN];
+	struct anm_vec3_track lpos, lscl;
+	struct anm_quat_track lrot;
+	const struct anm_track *trk = anim->tracks;
+
+	anm_init_vec3_track(&lpos);
+	anm_init_quat_track(&lrot);
+	anm_init_vec3_track(&lscl);
+
+	/* channels with keyframes on the legacy tracks instead, are converted
+	 * first, as they would be evaluated by anm_get_node_position etc.
+	 */
+	if(!anim->pos.count && trk && (trk[ANM_TRACK_POS_X].count |
+				trk[ANM_TRACK_POS_Y].count | trk[ANM_TRACK_POS_Z].count)) {
+		if(legacy_vec3(&lpos, trk + ANM_TRACK_POS_X) == -1) goto end;
+		vec3_src(src + CHAN_POS, &lpos);
+	} else {
+		vec3_src(src + CHAN_POS, &anim->pos);
+	}
+	if(!anim->rot.count && trk && trk[ANM_TRACK_ROT_X].count) {
+		if(legacy_quat(&lrot, trk + ANM_TRACK_ROT_X) == -1) goto end;
+		quat_src(src + CHAN_ROT, &lrot);
+	} else {
+		quat_src(src + CHAN_ROT, &anim->rot);
+	}
+	if(!anim->scl.count && trk && (trk[ANM_TRACK_SCL_X].count |
+				trk[ANM_TRACK_SCL_Y].count | trk[ANM_TRACK_SCL_Z].count)) {
+		if(legacy_vec3(&lscl, trk + ANM_TRACK_SCL_X) == -1) goto end;
+		vec3_src(src + CHAN_SCL, &lscl);
+	} else {
+		vec3_src(src + CHAN_SCL, &anim->scl);
+	}
+
+	memset(&fanim, 0, sizeof fanim);
+	fanim.name = put_str(fr, anim->name);
+
+	for(i=0; i<NUM_CHAN; i++) {
+		ch = fanim.chan + i;
+		ch->count = src[i].count;
+		ch->interp = src[i].interp;
+		ch->extrap = src[i].extrap;
+		memcpy(ch->def_val, src[i].def_val, src[i].ndef * sizeof *ch->def_val);
+
+		if(!src[i].count) continue;
+
+		/* store identical key times only once */
+		for(j=0; j<i; j++) {
+			if(src[j].count == src[i].count && memcmp(src[j].times, src[i].times,
+						src[i].count * sizeof *src[i].times) == 0) {
+				ch->times = fanim.chan[j].times;
+				break;
+			}
+		}
+		if(!ch->times) {
+			ch->times = put(fr, src[i].times, src[i].count * sizeof *src[i].times, FROZEN_ALIGN);
+		}
+		ch->keys = put(fr, src[i].keys, src[i].count * src[i].keysz, FROZEN_ALIGN);
+	}
+
+	if(fr->buf) {
+		memcpy(fr->buf + offs, &fanim, sizeof fanim);
+	}
+	res = 0;
+
+end:
+	anm_destroy_vec3_track(&lpos);
+	anm_destroy_quat_track(&lrot);
+	anm_destroy_vec3_track(&lscl);
+	return res;
+}
+
+/* reserves size bytes in the block, copying data there if it's not null,
+ * and returns their offset.
+ */
+static size_t put(struct freezer *fr, const void *data, size_t size, size_t align)
+{
+	size_t offs = (fr->size + align - 1) & ~(align - 1);
+
+	if(fr->buf && data) {
+		memcpy(fr->buf + offs, data, size);
+	}
+	fr->size = offs + size;
+	return offs;
+}
+
+static size_t put_str(struct freezer *fr, const char *str)
+{
+	return str ? put(fr, str, strlen(str) + 1, 1) : 0;
+}
+
+static void vec3_src(struct chan_src *src, const struct anm_vec3_track *trk)
+{
+	src->count = trk->count;
+	src->times = trk->times;
+	src->keys = trk->keys;
+	src->keysz = sizeof *trk->keys;
+	src->def_val = trk->def_val;
+	src->ndef = 3;
+	src->interp = trk->interp;
+	src->extrap = trk->extrap;
+}
+
+static void quat_src(struct chan_src *src, const struct anm_quat_track *trk)
+{
+	src->count = trk->count;
+	src->times = trk->times;
+	src->keys = trk->keys;
+	src->keysz = sizeof *trk->keys;
+	src->def_val = trk->def_val;
+	src->ndef = 4;
+	src->interp = trk->interp;
+	src->extrap = trk->extrap;
+}
+
+/* converts three scalar tracks to a vector track with a keyframe at each key
+ * time of any of them.
+ */
+static int legacy_vec3(struct anm_vec3_track *res, const struct anm_track *trk)
+{
+	int i, j;
+	float v[3];
+	anm_time_t tm;
+	struct anm_keyframe key;
+
+	for(i=0; i<3; i++) {
+		v[i] = trk[i].def_val;
+	}
+	anm_set_vec3_track_default(res, v);
+	anm_set_vec3_track_interpolator(res, trk->interp);
+	anm_set_vec3_track_extrapolator(res, trk->extrap);
+
+	for(i=0; i<3; i++) {
+		for(j=0; j<trk[i].count; j++) {
+			anm_get_keyframe_copy(trk + i, j, &key);
+			tm = key.time;
+			v[0] = anm_get_value(trk, tm);
+			v[1] = anm_get_value(trk + 1, tm);
+			v[2] = anm_get_value(trk + 2, tm);
+			if(anm_set_vec3_keyframe(res, tm, v) == -1) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/* converts four scalar quaternion tracks to a rotation track. Their rotation
+ * is interpolated at the key times of the x track (see anm_get_quat).
+ */
+static int legacy_quat(struct anm_quat_track *res, const struct anm_track *trk)
+{
+	int i;
+	float q[4];
+	anm_time_t tm;
+	struct anm_keyframe key;
+
+	for(i=0; i<4; i++) {
+		q[i] = trk[i].def_val;
+	}
+	anm_set_quat_track_default(res, q);
+	anm_set_quat_track_interpolator(res, trk->interp);
+	anm_set_quat_track_extrapolator(res, trk->extrap);
+
+	for(i=0; i<trk->count; i++) {
+		anm_get_keyframe_copy(trk, i, &key);
+		tm = key.time;
+		anm_get_quat(trk, trk + 1, trk + 2, trk + 3, tm, q);
+		if(anm_set_quat_keyframe(res, tm, q) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* appends the nodes of a tree in depth-first order. On failure, the array is
+ * freed and set to null.
+ */
+static void get_nodes(const struct anm_node *node, const struct anm_node ***nodes)
+{
+	const struct anm_node *c;
+	const struct anm_node **tmp;
+
+	if(!(tmp = anm_dynarr_push(*nodes, &node))) {
+		anm_dynarr_free(*nodes);
+		*nodes = 0;
+		return;
+	}
+	*nodes = tmp;
+
+	c = node->child;
+	while(c && *nodes) {
+		get_nodes(c, nodes);
+		c = c->next;
+	}
+}
+
+static int check_str(const struct anm_frozen *fz, unsigned int offs)
+{
+	if(!offs) return 1;
+	return offs < fz->size && memchr(FZ_PTR(fz, offs), 0, fz->size - offs) != 0;
+}
+
+static int check_array(const struct anm_frozen *fz, unsigned int offs, int count, size_t szelem)
+{
+	if(count < 0) return 0;
+	if(!count) return 1;
+	return !(offs & (FROZEN_ALIGN - 1)) && offs < fz->size &&
+		(size_t)count <= (fz->size - offs) / szelem;
+}
+
+static const struct frozen_node *get_node(const struct anm_frozen *fz, int node)
+{
+	if(node < 0 || node >= fz->num_nodes) {
+		return 0;
+	}
+	return (const struct frozen_node*)FZ_PTR(fz, fz->nodes) + node;
+}
+
+static const struct frozen_anim *get_anim(const struct anm_frozen *fz, int node, int anim)
+{
+	const struct frozen_node *fnode = get_node(fz, node);
+
+	if(!fnode || anim < 0 || anim >= fnode->num_anims) {
+		return 0;
+	}
+	return (const struct frozen_anim*)FZ_PTR(fz, fz->anims) + fnode->first_anim + anim;
+}
+
+/* The frozen channels are evaluated by the regular track functions, through
+ * track structures which point to the keyframes in the block. These never
+ * modify the keyframes, so the const qualifier is cast away.
+ */
+static void vec3_view(struct anm_vec3_track *trk, const struct anm_frozen *fz,
+		const struct frozen_chan *ch)
+{
+	trk->count = ch->count;
+	trk->times = (anm_time_t*)FZ_PTR(fz, ch->times);
+	trk->times_shared = 1;
+	trk->keys = (struct anm_vec3_key*)FZ_PTR(fz, ch->keys);
+	memcpy(trk->def_val, ch->def_val, sizeof trk->def_val);
+	trk->interp = (enum anm_interpolator)ch->interp;
+	trk->extrap = (enum anm_extrapolator)ch->extrap;
+}
+
+static void quat_view(struct anm_quat_track *trk, const struct anm_frozen *fz,
+		const struct frozen_chan *ch)
+{
+	trk->count = ch->count;
+	trk->times = (anm_time_t*)FZ_PTR(fz, ch->times);
+	trk->times_shared = 1;
+	trk->keys = (struct anm_quat_key*)FZ_PTR(fz, ch->keys);
+	memcpy(trk->def_val, ch->def_val, sizeof trk->def_val);
+	trk->interp = (enum anm_interpolator)ch->interp;
+	trk->extrap = (enum anm_extrapolator)ch->extrap;
+}
+
+static size_t page_size(void)
+{
+#ifdef _WIN32
+	return 4096;
+#else
+	long sz = sysconf(_SC_PAGESIZE);
+	return sz > 0 ? (size_t)sz : 4096;
+#endif
+}
+
+static void *alloc_pages(size_t size)
+{
+#ifdef _WIN32
+	return _aligned_malloc(size, page_size());
+#else
+	void *ptr;
+	if(posix_memalign(&ptr, page_size(), size) != 0) {
+		return 0;
+	}
+	return ptr;
+#endif
+}
+
+static void free_pages(void *ptr)
+{
+#ifdef _WIN32
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
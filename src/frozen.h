@@ -0,0 +1,102 @@
+/*
+libanim - hierarchical keyframe animation library
+Copyright (C) 2012-2023 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Frozen animations are compiled, read-only copies of the position, rotation
+ * and scaling keyframes of finished animations, which are evaluated directly
+ * from a single contiguous block of memory.
+ *
+ * A frozen block contains no pointers; everything in it is referenced by its
+ * offset from the start of the block. So it can be written to a file as is,
+ * and used from a read-only memory mapping of that file, or from shared
+ * memory by multiple processes at once. Blocks are created page-aligned,
+ * and their size is a multiple of the page size. The contents are in the
+ * native byte order, and depend on the size of anm_time_t, so they can only
+ * be used on the same kind of system that created them.
+ *
+ * A frozen block holds a number of nodes, each with any number of
+ * animations. Nodes and animations are referenced by index, and have the
+ * names of the anm_node and anm_animation they were created from, if any.
+ * Frozen animations are evaluated at animation-local time; playback offsets
+ * and blending are up to the caller.
+ */
+#ifndef LIBANIM_FROZEN_H_
+#define LIBANIM_FROZEN_H_
+
+#include <stddef.h>
+#include "anim.h"
+
+struct anm_frozen;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Creates a frozen block with a single unnamed node, holding a copy of anim.
+ * Channels with keyframes set on the legacy per-component tracks (see
+ * anm_get_animation_track) are converted to keyframes at every key time of
+ * any of their components. Cubic interpolation of such channels may change
+ * slightly, if the components had keyframes at different times.
+ * Returns null on failure.
+ */
+struct anm_frozen *anm_freeze_animation(const struct anm_animation *anim);
+/* Creates a frozen block with all the animations of every node of the tree.
+ * Nodes are stored in depth-first order, starting with tree at index 0.
+ */
+struct anm_frozen *anm_freeze_node_tree(const struct anm_node *tree);
+/* frees a frozen block created by one of the functions above */
+void anm_free_frozen(struct anm_frozen *fz);
+
+/* Checks that data holds a valid frozen block, previously created by this
+ * version of libanim, and returns it. The data are not copied, and must be
+ * aligned to at least 16 bytes (which is always the case with memory
+ * mappings). Returns null if the block is invalid, or truncated.
+ */
+const struct anm_frozen *anm_frozen_from_data(const void *data, size_t size);
+
+/* total size of the block in bytes */
+size_t anm_get_frozen_size(const struct anm_frozen *fz);
+
+int anm_get_frozen_node_count(const struct anm_frozen *fz);
+/* returns the name of a node, or null if it doesn't have one */
+const char *anm_get_frozen_node_name(const struct anm_frozen *fz, int node);
+/* returns the index of the first node with the given name, or -1 */
+int anm_find_frozen_node(const struct anm_frozen *fz, const char *name);
+
+int anm_get_frozen_animation_count(const struct anm_frozen *fz, int node);
+const char *anm_get_frozen_animation_name(const struct anm_frozen *fz, int node, int anim);
+int anm_find_frozen_animation(const struct anm_frozen *fz, int node, const char *name);
+
+/* Evaluate animation anim of a node at time tm, like the corresponding
+ * anm_get_node_* functions. Invalid node or animation indices result in the
+ * default position, rotation and scaling.
+ */
+void anm_get_frozen_position(const struct anm_frozen *fz, int node, int anim,
+		anm_time_t tm, float *pos);
+void anm_get_frozen_rotation(const struct anm_frozen *fz, int node, int anim,
+		anm_time_t tm, float *qrot);
+void anm_get_frozen_scaling(const struct anm_frozen *fz, int node, int anim,
+		anm_time_t tm, float *scale);
+/* same as anm_get_node_matrix, including the pivot point of the node */
+void anm_get_frozen_matrix(const struct anm_frozen *fz, int node, int anim,
+		anm_time_t tm, float *mat);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* LIBANIM_FROZEN_H_ */
@@ -0,0 +1,212 @@
+/*
+libanim - hierarchical keyframe animation library
+Copyright (C) 2012-2023 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include "pool.h"
+#include "anim.h"
+
+#ifdef ANIM_THREAD_SAFE
+#include <pthread.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+struct pool_job {
+	void (*func)(void*, int);
+	void *cls;
+	int count;
+	int next, done;
+};
+
+static void *worker(void *arg);
+static int start_workers(void);
+static void stop_workers(void);
+static void run_items(struct pool_job *job);
+static int num_cpus(void);
+
+/* serializes anm_pool_run calls, held for the duration of a job */
+static pthread_mutex_t run_lock = PTHREAD_MUTEX_INITIALIZER;
+/* protects everything below */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+static pthread_t *workers;
+static int num_workers;
+static int quit;
+static struct pool_job *cur_job;
+#endif	/* ANIM_THREAD_SAFE */
+
+static int num_threads;	/* requested with anm_set_thread_count, 0 for automatic */
+
+void anm_set_thread_count(int n)
+{
+#ifdef ANIM_THREAD_SAFE
+	/* the workers are restarted with the new count, when they're next needed */
+	pthread_mutex_lock(&run_lock);
+	stop_workers();
+	num_threads = n < 0 ? 0 : n;
+	pthread_mutex_unlock(&run_lock);
+#else
+	num_threads = n < 0 ? 0 : n;
+#endif
+}
+
+int anm_get_thread_count(void)
+{
+	return num_threads;
+}
+
+int anm_pool_size(void)
+{
+#ifdef ANIM_THREAD_SAFE
+	return num_threads > 0 ? num_threads : num_cpus();
+#else
+	return 1;
+#endif
+}
+
+void anm_pool_run(void (*func)(void*, int), void *cls, int count)
+{
+	int i;
+#ifdef ANIM_THREAD_SAFE
+	struct pool_job job;
+
+	if(count > 1 && pthread_mutex_trylock(&run_lock) == 0) {
+		pthread_mutex_lock(&lock);
+		if(start_workers() > 0) {
+			job.func = func;
+			job.cls = cls;
+			job.count = count;
+			job.next = job.done = 0;
+
+			cur_job = &job;
+			pthread_cond_broadcast(&work_cond);
+
+			run_items(&job);
+			while(job.done < job.count) {
+				pthread_cond_wait(&done_cond, &lock);
+			}
+			cur_job = 0;
+
+			pthread_mutex_unlock(&lock);
+			pthread_mutex_unlock(&run_lock);
+			return;
+		}
+		pthread_mutex_unlock(&lock);
+		pthread_mutex_unlock(&run_lock);
+	}
+#endif
+
+	for(i=0; i<count; i++) {
+		func(cls, i);
+	}
+}
+
+#ifdef ANIM_THREAD_SAFE
+static void *worker(void *arg)
+{
+	pthread_mutex_lock(&lock);
+	for(;;) {
+		while(!quit && (!cur_job || cur_job->next >= cur_job->count)) {
+			pthread_cond_wait(&work_cond, &lock);
+		}
+		if(quit) break;
+
+		run_items(cur_job);
+	}
+	pthread_mutex_unlock(&lock);
+	return 0;
+}
+
+/* Starts the worker threads, if they're not running already. Called with
+ * lock held. Returns the number of workers, which may be less than requested
+ * if starting some of them failed.
+ */
+static int start_workers(void)
+{
+	int count;
+
+	if(workers) {
+		return num_workers;
+	}
+
+	count = anm_pool_size() - 1;
+	if(count <= 0 || !(workers = malloc(count * sizeof *workers))) {
+		return 0;
+	}
+	quit = 0;
+	for(num_workers=0; num_workers<count; num_workers++) {
+		if(pthread_create(workers + num_workers, 0, worker, 0) != 0) {
+			break;
+		}
+	}
+	return num_workers;
+}
+
+/* stops all worker threads, called with run_lock held */
+static void stop_workers(void)
+{
+	int i;
+
+	pthread_mutex_lock(&lock);
+	quit = 1;
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&lock);
+
+	for(i=0; i<num_workers; i++) {
+		pthread_join(workers[i], 0);
+	}
+	free(workers);
+	workers = 0;
+	num_workers = 0;
+}
+
+/* runs items of the job until there are none left, called with lock held */
+static void run_items(struct pool_job *job)
+{
+	int idx;
+
+	while(job->next < job->count) {
+		idx = job->next++;
+
+		pthread_mutex_unlock(&lock);
+		job->func(job->cls, idx);
+		pthread_mutex_lock(&lock);
+
+		if(++job->done == job->count) {
+			pthread_cond_broadcast(&done_cond);
+		}
+	}
+}
+
+static int num_cpus(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+#else
+	return 1;
+#endif
+}
+#endif	/* ANIM_THREAD_SAFE */
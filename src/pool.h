@@ -0,0 +1,39 @@
+/*
+libanim - hierarchical keyframe animation library
+Copyright (C) 2012-2023 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Internal worker thread pool, used by the functions which split their work
+ * across multiple threads. Without ANIM_THREAD_SAFE, all work is done by the
+ * calling thread.
+ */
+#ifndef LIBANIM_POOL_H_
+#define LIBANIM_POOL_H_
+
+#include "config.h"
+
+/* Calls func(cls, i) for every i in [0, count), and returns when all calls
+ * have finished. The calls are distributed to the pool threads and the
+ * calling thread, in no particular order. If the pool is already busy with
+ * work submitted by another thread, or if it's used from within func, all
+ * calls are made by the calling thread.
+ */
+void anm_pool_run(void (*func)(void*, int), void *cls, int count);
+
+/* number of threads which take part in anm_pool_run, including the caller */
+int anm_pool_size(void);
+
+#endif	/* LIBANIM_POOL_H_ */
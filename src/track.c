@@ -22,44 +22,291 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "track.h"
 #include "dynarr.h"
 
+#ifdef ANIM_THREAD_SAFE
+#include <pthread.h>
+#endif
+
 #include "cgmath/cgmath.h"
 
-static int keycmp(const void *a, const void *b);
+/* The evaluators are written once, with the key layout and interpolation and
+ * extrapolation modes as arguments, and instantiated for each layout by
+ * calling them with a constant (see eval_track and anm_get_values). Forcing
+ * them inline makes each instance a specialized copy with the layout checks
+ * folded away.
+ */
+#if defined(__GNUC__)
+#define FORCE_INLINE	__inline__ __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define FORCE_INLINE	__forceinline
+#else
+#define FORCE_INLINE
+#endif
+
+/* Acquire loads and release stores, of any type up to pointer size. Used for
+ * data shared between threads without a lock: streaming tracks, the slerp
+ * cache pointer, and the lazy update flags.
+ */
+#if defined(__GNUC__)
+#define ATOMIC_LOAD(p, res)		__atomic_load(p, res, __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(p, val)	__atomic_store(p, val, __ATOMIC_RELEASE)
+#elif defined(_MSC_VER)
+/* x86/x64 only reorders stores after loads, so compiler barriers suffice */
+#include <intrin.h>
+#define ATOMIC_LOAD(p, res)		(*(res) = *(p), _ReadWriteBarrier())
+#define ATOMIC_STORE(p, val)	(_ReadWriteBarrier(), *(p) = *(val))
+#else
+/* no atomics, lock-free sharing is only safe from a single thread */
+#define ATOMIC_LOAD(p, res)		(*(res) = *(p))
+#define ATOMIC_STORE(p, val)	(*(p) = *(val))
+#endif
+
+static int set_key(struct anm_track *track, struct anm_keyframe *key);
+static void update_track(struct anm_track *track);
+static void calc_cubic_coef(struct anm_track *track);
+static void calc_cubic_seg(struct anm_track *track, int seg);
+static void key_value_changed(struct anm_track *track, int idx);
+static void build_index(struct anm_track *track);
+static int fill_index(struct anm_search_index *index, const struct anm_track *track,
+		int kidx, int node);
+static void free_index(struct anm_search_index *index);
+static int find_prev_index(const struct anm_search_index *index, anm_time_t tm);
+static int merge_keys(struct anm_track *track, const struct anm_keyframe *keys, int count);
+static void sort_keys(struct anm_keyframe *keys, struct anm_keyframe *tmp, int n);
+static int append_key(struct anm_track *track, const struct anm_keyframe *key);
+static int resize_keys(struct anm_track *track, int count);
+static void *lazy_push(void *da, const void *item, int szelem);
+static int lazy_resize(void **da, int count, int szelem);
+static void copy_keys(struct anm_keyframe *dest, const struct anm_track *track, int start, int count);
 static int find_prev_key(const struct anm_keyframe *arr, int start, int end, anm_time_t tm);
-
-static float interp_step(float v0, float v1, float v2, float v3, float t);
-static float interp_linear(float v0, float v1, float v2, float v3, float t);
+static int find_prev_time(const anm_time_t *times, int count, anm_time_t tm);
+static FORCE_INLINE int key_interval(const struct anm_track *track, anm_time_t tm,
+		enum anm_key_layout layout);
+static FORCE_INLINE int key_interval_cursor(const struct anm_track *track, anm_time_t tm,
+		struct anm_cursor *cur, enum anm_key_layout layout);
+static FORCE_INLINE int key_in_interval(const struct anm_track *track, int idx, anm_time_t tm,
+		enum anm_key_layout layout);
+static float eval_track(const struct anm_track *track, anm_time_t tm, struct anm_cursor *cur);
+static FORCE_INLINE float eval_keys(const struct anm_track *track, anm_time_t tm,
+		struct anm_cursor *cur, enum anm_key_layout layout);
+static FORCE_INLINE void eval_batch(const struct anm_track *track, const anm_time_t *times,
+		int n, float *out, enum anm_key_layout layout);
+static FORCE_INLINE int next_interval(const struct anm_track *track, int idx, anm_time_t tm,
+		enum anm_key_layout layout);
+static void remap_times(const struct anm_track *track, const anm_time_t *times, anm_time_t *res,
+		int n, anm_time_t start, anm_time_t end);
+static void eval_quat(const struct anm_track *xtrk, const struct anm_track *ytrk,
+		const struct anm_track *ztrk, const struct anm_track *wtrk, anm_time_t tm,
+		float *qres, struct anm_cursor *cur);
+static int slerp_cache_valid(const struct anm_slerp_cache *sc, const struct anm_track *xtrk,
+		const struct anm_track *ytrk, const struct anm_track *ztrk, const struct anm_track *wtrk);
+static struct anm_slerp_cache *update_slerp_cache(const struct anm_track *xtrk,
+		const struct anm_track *ytrk, const struct anm_track *ztrk, const struct anm_track *wtrk);
+static void free_slerp_cache(struct anm_slerp_cache *sc);
+
+static struct anm_quant_keys *alloc_quant(int count, int val_bits, int wide_times);
+static struct anm_quant_keys *copy_quant(const struct anm_quant_keys *q, int count);
+static int find_prev_quant(const struct anm_quant_keys *q, int count, anm_time_t tm);
+
+static int times_interval(const anm_time_t *times, int count, anm_time_t tm);
+static int times_interval_cursor(const anm_time_t *times, int count, anm_time_t tm,
+		struct anm_cursor *cur);
+static int insert_key(anm_time_t **times, int *shared, void **keys, size_t keysz, int count,
+		anm_time_t tm, const void *key);
+static int own_times(anm_time_t **times, int *shared, int count);
+static void eval_vec3_track(const struct anm_vec3_track *track, anm_time_t tm, float *res,
+		struct anm_cursor *cur);
+static void eval_quat_track(const struct anm_quat_track *track, anm_time_t tm, float *qres,
+		struct anm_cursor *cur);
+static void calc_quat_seg(struct anm_quat_key *k0, const struct anm_quat_key *k1);
+
+struct simplify;
+static int simplify(struct anm_track **trk, int ntrk, float max_err, int quat);
+static int init_simplify(struct simplify *s, int count, int ntrk, enum anm_interpolator interp,
+		float max_err, int quat);
+static void destroy_simplify(struct simplify *s);
+static int simplify_keys(struct simplify *s);
+static int simplify_check(const struct simplify *s, int first, int last);
+static void simplify_eval(const struct simplify *s, int a, anm_time_t tm, float *res);
+static float simplify_error(const struct simplify *s, const float *v1, const float *v2);
+static int same_key_times(struct anm_track **trk, int ntrk);
+
+struct event_query;
+static void event_range(const struct anm_event_track *track, struct event_query *q);
+static int find_events(const struct anm_event_track *track, const struct event_query *q,
+		anm_time_t t0, anm_time_t t1, struct anm_event *res, int max);
+static int events_fwd(const struct anm_event *ev, int lo, int hi, anm_time_t offs,
+		anm_time_t t0, anm_time_t t1, struct anm_event *res, int n, int max);
+static int events_back(const struct anm_event *ev, int lo, int hi, anm_time_t mirror,
+		anm_time_t t0, anm_time_t t1, struct anm_event *res, int n, int max);
+static int event_bound(const struct anm_event *ev, int count, anm_time_t tm, int incl);
+static anm_time_t floor_div(anm_time_t a, anm_time_t b);
+
+static FORCE_INLINE float interpolate(enum anm_interpolator in, float v0, float v1,
+		float v2, float v3, float t);
 static float interp_cubic(float v0, float v1, float v2, float v3, float t);
 
+static FORCE_INLINE anm_time_t remap(enum anm_extrapolator ex, anm_time_t tm,
+		anm_time_t start, anm_time_t end);
 static anm_time_t remap_extend(anm_time_t tm, anm_time_t start, anm_time_t end);
 static anm_time_t remap_clamp(anm_time_t tm, anm_time_t start, anm_time_t end);
 static anm_time_t remap_repeat(anm_time_t tm, anm_time_t start, anm_time_t end);
 static anm_time_t remap_pingpong(anm_time_t tm, anm_time_t start, anm_time_t end);
 
-/* XXX keep this in sync with enum anm_interpolator at track.h */
-static float (*interp[])(float, float, float, float, float) = {
-	interp_step,
-	interp_linear,
-	interp_cubic,
-	0
+/* Quantized keyframes (ANM_KEYS_QUANTIZED). Keys are grouped in blocks of
+ * QUANT_BLOCK_SIZE, and key times are stored as 16bit (or 32bit if
+ * necessary) offsets from the time of the first key in their block. Values
+ * are normalized to the range of the track and stored as 8 or 16bit
+ * integers.
+ */
+#define QUANT_BLOCK_SHIFT	5
+#define QUANT_BLOCK_SIZE	(1 << QUANT_BLOCK_SHIFT)
+
+struct anm_quant_keys {
+	int val_bits, wide_times;
+	float vmin, vscale;		/* val = vmin + qval * vscale */
+	anm_time_t *base;		/* time of the first key of each block */
+	unsigned short *toffs;	/* 16bit time offsets */
+	unsigned int *toffs32;	/* 32bit time offsets (wide_times) */
+	unsigned short *vals;	/* 16bit values */
+	unsigned char *vals8;	/* 8bit values */
+};
+
+#define QUANT_TIME(q, i) \
+	((q)->base[(i) >> QUANT_BLOCK_SHIFT] + \
+	 (anm_time_t)((q)->wide_times ? (q)->toffs32[i] : (q)->toffs[i]))
+#define QUANT_VAL(q, i) \
+	((q)->vmin + (float)((q)->val_bits > 8 ? (q)->vals[i] : (q)->vals8[i]) * (q)->vscale)
+
+/* key accessors, independent of the keyframe storage layout. The LKEY_
+ * variants take the layout separately, which reduces them to a single access
+ * when it's a constant.
+ */
+#define LKEY_TIME(trk, lay, i) \
+	((lay) == ANM_KEYS_AOS ? (trk)->keys[i].time : \
+	 (lay) == ANM_KEYS_SOA ? (trk)->times[i] : \
+	 (lay) == ANM_KEYS_SAMPLED ? (trk)->tstart + (anm_time_t)(i) * (trk)->period : \
+	 QUANT_TIME((trk)->quant, i))
+#define LKEY_VAL(trk, lay, i) \
+	((lay) == ANM_KEYS_AOS ? (trk)->keys[i].val : \
+	 (lay) == ANM_KEYS_QUANTIZED ? QUANT_VAL((trk)->quant, i) : (trk)->vals[i])
+
+#define KEY_TIME(trk, i)	LKEY_TIME(trk, (trk)->layout, i)
+#define KEY_VAL(trk, i)		LKEY_VAL(trk, (trk)->layout, i)
+
+/* layouts which can't hold arbitrary keyframes, and are converted to
+ * ANM_KEYS_SOA before keys are inserted into them.
+ */
+#define PACKED_LAYOUT(trk) \
+	((trk)->layout == ANM_KEYS_SAMPLED || (trk)->layout == ANM_KEYS_QUANTIZED)
+
+/* key times of ANM_KEYS_SAMPLED tracks are implicit and can't be set, and
+ * ANM_KEYS_QUANTIZED tracks are read-only.
+ */
+#define SET_KEY(trk, i, tm, v) \
+	do { \
+		if((trk)->layout == ANM_KEYS_AOS) { \
+			(trk)->keys[i].time = (tm); \
+			(trk)->keys[i].val = (v); \
+		} else { \
+			if((trk)->times) (trk)->times[i] = (tm); \
+			(trk)->vals[i] = (v); \
+		} \
+	} while(0)
+
+/* Brings lazily maintained track data up to date before it's accessed. With
+ * thread safety, the check is an acquire load, so that a thread which finds
+ * the track clean also sees the data another thread just updated.
+ */
+#ifdef ANIM_THREAD_SAFE
+#define UPDATE_TRACK(trk) \
+	do { \
+		int dirty_; \
+		ATOMIC_LOAD(&(trk)->dirty, &dirty_); \
+		if(dirty_) update_track((struct anm_track*)(trk)); \
+	} while(0)
+#else
+#define UPDATE_TRACK(trk) \
+	do { \
+		if((trk)->dirty) update_track((struct anm_track*)(trk)); \
+	} while(0)
+#endif
+
+/* lazy update flags (track->dirty) */
+#define DIRTY_KEYS	1	/* key times changed: pending sort, search index */
+#define DIRTY_COEF	2	/* key values changed: cubic coefficients */
+#define DIRTY_ALL	(DIRTY_KEYS | DIRTY_COEF)
+
+/* options which keep data derived from the keyframes, rebuilt by update_track */
+#define DERIVED_OPT_MASK	(1 << ANM_TRACK_CUBIC_CACHE)
+
+#define KEYS_CHANGED(trk) \
+	do { \
+		(trk)->rev++; \
+		if(((trk)->opt & DERIVED_OPT_MASK) || (trk)->count >= INDEX_MIN_KEYS || (trk)->index) { \
+			(trk)->dirty |= DIRTY_ALL; \
+		} \
+	} while(0)
+
+/* for edits which don't move any keyframe in time, and leave the index alone */
+#define VALUES_CHANGED(trk) \
+	do { \
+		(trk)->rev++; \
+		if((trk)->opt & DERIVED_OPT_MASK) { \
+			(trk)->dirty |= DIRTY_COEF; \
+		} \
+	} while(0)
+
+/* cubic coefficients are up to date, and span every segment */
+#define COEF_VALID(trk) \
+	((trk)->coef && !((trk)->dirty & DIRTY_COEF))
+
+/* tracks with at least this many keyframes get a search index. The branchless
+ * search of ANM_KEYS_SOA tracks keeps up with the index for longer. Both are
+ * measured by example/bench_search.c, and can be overriden at build time.
+ */
+#ifndef INDEX_MIN_KEYS
+#define INDEX_MIN_KEYS		16
+#endif
+#ifndef INDEX_MIN_KEYS_SOA
+#define INDEX_MIN_KEYS_SOA	65536
+#endif
+
+#define NEED_INDEX(trk) \
+	(!PACKED_LAYOUT(trk) && \
+	 (trk)->count >= ((trk)->layout == ANM_KEYS_SOA ? INDEX_MIN_KEYS_SOA : INDEX_MIN_KEYS))
+
+/* Key times in Eytzinger (breadth-first binary tree) order, which keeps the
+ * first levels of a binary search packed in a few cache lines, and lets the
+ * search prefetch the next levels. idx maps tree nodes back to key indices.
+ */
+struct anm_search_index {
+	int count;
+	anm_time_t *times;	/* 1-based */
+	int *idx;
 };
 
-/* XXX keep this in sync with enum anm_extrapolator at track.h */
-static anm_time_t (*remap_time[])(anm_time_t, anm_time_t, anm_time_t) = {
-	remap_extend,
-	remap_clamp,
-	remap_repeat,
-	remap_pingpong,
-	0
+struct slerp_seg {
+	float angle, inv_sin, sign;
 };
 
+/* only prev is modified once published, see update_slerp_cache */
+struct anm_slerp_cache {
+	const struct anm_track *trk[4];	/* tracks and revisions the cache was built from */
+	unsigned int rev[4];
+	int nseg;
+	struct slerp_seg *seg;	/* allocated along with the cache */
+	struct anm_slerp_cache *prev;	/* the cache this one replaced, not used by readers */
+};
+
+#ifdef ANIM_THREAD_SAFE
+static pthread_mutex_t update_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 int anm_init_track(struct anm_track *track)
 {
+	/* keyframe arrays are allocated when the first keyframe is added */
 	memset(track, 0, sizeof *track);
 
-	if(!(track->keys = anm_dynarr_alloc(0, sizeof *track->keys))) {
-		return -1;
-	}
 	track->interp = ANM_INTERP_LINEAR;
 	track->extrap = ANM_EXTRAP_CLAMP;
 	return 0;
@@ -68,6 +315,12 @@ int anm_init_track(struct anm_track *track)
 void anm_destroy_track(struct anm_track *track)
 {
 	anm_dynarr_free(track->keys);
+	anm_dynarr_free(track->times);
+	anm_dynarr_free(track->vals);
+	free(track->coef);
+	free_slerp_cache(track->slerp);
+	free_index(track->index);
+	free(track->quant);
 }
 
 struct anm_track *anm_create_track(void)
@@ -91,10 +344,23 @@ void anm_free_track(struct anm_track *track)
 
 void anm_copy_track(struct anm_track *dest, const struct anm_track *src)
 {
+	UPDATE_TRACK(src);
+
 	free(dest->name);
-	if(dest->keys) {
-		anm_dynarr_free(dest->keys);
-	}
+	anm_dynarr_free(dest->keys);
+	anm_dynarr_free(dest->times);
+	anm_dynarr_free(dest->vals);
+	free(dest->coef);
+	free_slerp_cache(dest->slerp);
+	free_index(dest->index);
+	free(dest->quant);
+	dest->keys = 0;
+	dest->times = 0;
+	dest->vals = 0;
+	dest->coef = 0;
+	dest->slerp = 0;
+	dest->index = 0;
+	dest->quant = 0;
 
 	if(src->name) {
 		dest->name = malloc(strlen(src->name) + 1);
@@ -102,8 +368,28 @@ void anm_copy_track(struct anm_track *dest, const struct anm_track *src)
 	}
 
 	dest->count = src->count;
-	dest->keys = anm_dynarr_alloc(src->count, sizeof *dest->keys);
-	memcpy(dest->keys, src->keys, src->count * sizeof *dest->keys);
+	if(src->keys) {
+		dest->keys = anm_dynarr_alloc(src->count, sizeof *dest->keys);
+		memcpy(dest->keys, src->keys, src->count * sizeof *dest->keys);
+	}
+	if(src->times) {
+		dest->times = anm_dynarr_alloc(src->count, sizeof *dest->times);
+		memcpy(dest->times, src->times, src->count * sizeof *dest->times);
+	}
+	if(src->vals) {
+		dest->vals = anm_dynarr_alloc(src->count, sizeof *dest->vals);
+		memcpy(dest->vals, src->vals, src->count * sizeof *dest->vals);
+	}
+	if(src->quant) {
+		dest->quant = copy_quant(src->quant, src->count);
+	}
+	dest->layout = src->layout;
+	dest->tstart = src->tstart;
+	dest->period = src->period;
+	dest->nsorted = src->count;
+	dest->opt = src->opt;
+	dest->dirty = 0;
+	KEYS_CHANGED(dest);
 
 	dest->def_val = src->def_val;
 	dest->interp = src->interp;
@@ -139,7 +425,7 @@ void anm_set_track_extrapolator(struct anm_track *track, enum anm_extrapolator e
 
 anm_time_t anm_remap_time(const struct anm_track *track, anm_time_t tm, anm_time_t start, anm_time_t end)
 {
-	return remap_time[track->extrap](tm, start, end);
+	return remap(track->extrap, tm, start, end);
 }
 
 void anm_set_track_default(struct anm_track *track, float def)
@@ -147,208 +433,2883 @@ void anm_set_track_default(struct anm_track *track, float def)
 	track->def_val = def;
 }
 
-int anm_set_keyframe(struct anm_track *track, struct anm_keyframe *key)
+int anm_set_track_layout(struct anm_track *track, enum anm_key_layout layout)
 {
-	int idx = anm_get_key_interval(track, key->time);
+	int i;
+	anm_time_t period = 1;
+	struct anm_keyframe *keys = 0;
+	anm_time_t *times = 0;
+	float *vals = 0;
 
-	/* if we got a valid keyframe index, compare them... */
-	if(idx >= 0 && idx < track->count && keycmp(key, track->keys + idx) == 0) {
-		/* ... it's the same key, just update the value */
-		track->keys[idx].val = key->val;
-	} else {
-		/* ... it's a new key, add it and re-sort them */
-		void *tmp;
-		if(!(tmp = anm_dynarr_push(track->keys, key))) {
+	if(layout == track->layout) {
+		return 0;
+	}
+	if(layout == ANM_KEYS_QUANTIZED) {
+		return anm_quantize_track(track, 16);
+	}
+	UPDATE_TRACK(track);
+
+	if(layout == ANM_KEYS_SAMPLED) {
+		/* only possible if the keyframes are uniformly spaced */
+		if(track->count > 1) {
+			period = KEY_TIME(track, 1) - KEY_TIME(track, 0);
+		}
+		for(i=2; i<track->count; i++) {
+			if(KEY_TIME(track, i) - KEY_TIME(track, i - 1) != period) {
+				return -1;
+			}
+		}
+	}
+
+	switch(layout) {
+	case ANM_KEYS_AOS:
+		if(!(keys = anm_dynarr_alloc(track->count, sizeof *keys))) {
 			return -1;
 		}
-		track->keys = tmp;
-		/* TODO lazy qsort */
-		qsort(track->keys, ++track->count, sizeof *track->keys, keycmp);
+		for(i=0; i<track->count; i++) {
+			keys[i].time = KEY_TIME(track, i);
+			keys[i].val = KEY_VAL(track, i);
+		}
+		break;
+
+	case ANM_KEYS_SOA:
+		if(!(times = anm_dynarr_alloc(track->count, sizeof *times))) {
+			return -1;
+		}
+		for(i=0; i<track->count; i++) {
+			times[i] = KEY_TIME(track, i);
+		}
+		/* fallthrough */
+	case ANM_KEYS_SAMPLED:
+		if(!(vals = track->vals)) {
+			if(!(vals = anm_dynarr_alloc(track->count, sizeof *vals))) {
+				anm_dynarr_free(times);
+				return -1;
+			}
+			for(i=0; i<track->count; i++) {
+				vals[i] = KEY_VAL(track, i);
+			}
+		}
+		break;
+
+	default:
+		return -1;
+	}
+
+	if(layout == ANM_KEYS_SAMPLED) {
+		track->tstart = track->count ? KEY_TIME(track, 0) : 0;
+		track->period = period;
+	}
+
+	anm_dynarr_free(track->keys);
+	anm_dynarr_free(track->times);
+	if(track->vals != vals) {
+		anm_dynarr_free(track->vals);
+	}
+	free(track->quant);
+	track->keys = keys;
+	track->times = times;
+	track->vals = vals;
+	track->quant = 0;
+
+	track->layout = layout;
+	if(NEED_INDEX(track) || track->index) {
+		track->dirty |= DIRTY_KEYS;
 	}
 	return 0;
 }
 
-static int keycmp(const void *a, const void *b)
+int anm_set_track_samples(struct anm_track *track, anm_time_t start, anm_time_t period,
+		const float *vals, int count)
 {
-	return ((struct anm_keyframe*)a)->time - ((struct anm_keyframe*)b)->time;
+	float *tmp;
+
+	if(period <= 0 || !(tmp = anm_dynarr_alloc(count, sizeof *tmp))) {
+		return -1;
+	}
+	memcpy(tmp, vals, count * sizeof *tmp);
+
+	anm_dynarr_free(track->keys);
+	anm_dynarr_free(track->times);
+	anm_dynarr_free(track->vals);
+	free(track->quant);
+	track->keys = 0;
+	track->times = 0;
+	track->vals = tmp;
+	track->quant = 0;
+
+	track->layout = ANM_KEYS_SAMPLED;
+	track->tstart = start;
+	track->period = period;
+	track->count = track->nsorted = count;
+	KEYS_CHANGED(track);
+	return 0;
 }
 
-struct anm_keyframe *anm_get_keyframe(const struct anm_track *track, int idx)
+int anm_quantize_track(struct anm_track *track, int val_bits)
 {
-	if(idx < 0 || idx >= track->count) {
-		return 0;
+	int i, qmax, wide_times = 0;
+	anm_time_t offs;
+	float val, vmin, vmax;
+	struct anm_quant_keys *q;
+
+	if(val_bits != 8 && val_bits != 16) {
+		return -1;
 	}
-	return track->keys + idx;
+	UPDATE_TRACK(track);
+
+	if(!track->count) {
+		/* nothing to compress, just make sure the track stays empty */
+		vmin = vmax = 0.0f;
+	} else {
+		vmin = vmax = KEY_VAL(track, 0);
+	}
+	for(i=1; i<track->count; i++) {
+		val = KEY_VAL(track, i);
+		if(val < vmin) vmin = val;
+		if(val > vmax) vmax = val;
+		offs = KEY_TIME(track, i) - KEY_TIME(track, i & ~(QUANT_BLOCK_SIZE - 1));
+		if(offs > USHRT_MAX) {
+			if(offs > UINT_MAX) {
+				return -1;
+			}
+			wide_times = 1;
+		}
+	}
+
+	if(!(q = alloc_quant(track->count, val_bits, wide_times))) {
+		return -1;
+	}
+	qmax = (1 << val_bits) - 1;
+	q->vmin = vmin;
+	q->vscale = (vmax - vmin) / (float)qmax;
+
+	for(i=0; i<track->count; i++) {
+		if(!(i & (QUANT_BLOCK_SIZE - 1))) {
+			q->base[i >> QUANT_BLOCK_SHIFT] = KEY_TIME(track, i);
+		}
+		offs = KEY_TIME(track, i) - q->base[i >> QUANT_BLOCK_SHIFT];
+		if(wide_times) {
+			q->toffs32[i] = offs;
+		} else {
+			q->toffs[i] = offs;
+		}
+
+		val = vmax > vmin ? (KEY_VAL(track, i) - vmin) / (vmax - vmin) * (float)qmax : 0.0f;
+		if(val_bits > 8) {
+			q->vals[i] = (unsigned short)(val + 0.5f);
+		} else {
+			q->vals8[i] = (unsigned char)(val + 0.5f);
+		}
+	}
+
+	anm_dynarr_free(track->keys);
+	anm_dynarr_free(track->times);
+	anm_dynarr_free(track->vals);
+	free(track->quant);
+	track->keys = 0;
+	track->times = 0;
+	track->vals = 0;
+	track->quant = q;
+
+	track->layout = ANM_KEYS_QUANTIZED;
+	track->nsorted = track->count;
+	KEYS_CHANGED(track);
+	if(track->index) {
+		track->dirty |= DIRTY_KEYS;
+	}
+	return 0;
 }
 
-int anm_get_key_interval(const struct anm_track *track, anm_time_t tm)
+enum anm_key_layout anm_get_track_layout(const struct anm_track *track)
 {
-	int last;
+	return track->layout;
+}
+
+int anm_set_keyframe(struct anm_track *track, struct anm_keyframe *key)
+{
+	return set_key(track, key);
+}
+
+static int set_key(struct anm_track *track, struct anm_keyframe *key)
+{
+	int idx, last;
 
-	if(!track->count || tm < track->keys[0].time) {
+	if(track->layout == ANM_KEYS_SAMPLED) {
+		if(!track->count) {
+			track->tstart = key->time;
+		}
+		idx = (key->time - track->tstart) / track->period;
+		if(key->time < track->tstart || idx > track->count ||
+				key->time != track->tstart + idx * track->period) {
+			/* not on a sample, the track needs explicit key times from now on */
+			if(anm_set_track_layout(track, ANM_KEYS_SOA) == -1) {
+				return -1;
+			}
+		} else {
+			if(idx < track->count) {
+				track->vals[idx] = key->val;
+				key_value_changed(track, idx);
+				return 0;
+			}
+			if(append_key(track, key) == -1) {
+				return -1;
+			}
+			track->nsorted = track->count;
+			KEYS_CHANGED(track);
+			return 0;
+		}
+	}
+	if(track->layout == ANM_KEYS_QUANTIZED && anm_set_track_layout(track, ANM_KEYS_SOA) == -1) {
 		return -1;
 	}
 
+	if(!track->count || key->time > KEY_TIME(track, track->count - 1)) {
+		/* appending past the end never breaks the order */
+		if(append_key(track, key) == -1) {
+			return -1;
+		}
+		if(track->nsorted == track->count - 1) {
+			track->nsorted = track->count;
+		}
+		KEYS_CHANGED(track);
+		return 0;
+	}
+
+	if(track->opt & (1 << ANM_TRACK_LAZY_SORT) && !PACKED_LAYOUT(track)) {
+		/* defer sorting until the track is evaluated */
+		if(append_key(track, key) == -1) {
+			return -1;
+		}
+		KEYS_CHANGED(track);
+		track->dirty |= DIRTY_KEYS;
+		return 0;
+	}
+	if(track->nsorted < track->count) {
+		UPDATE_TRACK(track);	/* lazy sorting was turned off with keys pending */
+	}
+
+	/* Bisect the keyframes directly. The search index may be out of date, and
+	 * rebuilding it on every edit would make editing long tracks O(n).
+	 */
 	last = track->count - 1;
-	if(tm > track->keys[last].time) {
-		return last;
+	if(key->time < KEY_TIME(track, 0)) {
+		idx = -1;
+	} else if(track->layout == ANM_KEYS_SOA) {
+		idx = find_prev_time(track->times, track->count, key->time);
+	} else {
+		idx = find_prev_key(track->keys, 0, last, key->time);
 	}
 
-	return find_prev_key(track->keys, 0, last, tm);
+	/* exact hits on the last keyframe are reported as part of the last interval */
+	if(idx + 1 == last && KEY_TIME(track, last) == key->time) {
+		idx = last;
+	}
+
+	if(idx >= 0 && KEY_TIME(track, idx) == key->time) {
+		/* it's the same key, just update the value */
+		SET_KEY(track, idx, key->time, key->val);
+		key_value_changed(track, idx);
+		return 0;
+	}
+
+	/* it's a new key, insert it after the start of the interval */
+	if(append_key(track, key) == -1) {
+		return -1;
+	}
+	idx++;
+	last = track->count - 1;
+	if(track->layout == ANM_KEYS_SOA) {
+		memmove(track->times + idx + 1, track->times + idx, (last - idx) * sizeof *track->times);
+		memmove(track->vals + idx + 1, track->vals + idx, (last - idx) * sizeof *track->vals);
+	} else {
+		memmove(track->keys + idx + 1, track->keys + idx, (last - idx) * sizeof *track->keys);
+	}
+	SET_KEY(track, idx, key->time, key->val);
+	track->nsorted = track->count;
+	KEYS_CHANGED(track);
+	return 0;
 }
 
-static int find_prev_key(const struct anm_keyframe *arr, int start, int end, anm_time_t tm)
+int anm_set_keyframes(struct anm_track *track, const struct anm_keyframe *keys, int count)
 {
-	int mid;
+	int i;
 
-	if(end - start <= 1) {
-		return start;
+	if(track->opt & (1 << ANM_TRACK_LAZY_SORT) && !PACKED_LAYOUT(track)) {
+		for(i=0; i<count; i++) {
+			if(append_key(track, keys + i) == -1) {
+				break;
+			}
+		}
+		KEYS_CHANGED(track);
+		track->dirty |= DIRTY_KEYS;
+		return i < count ? -1 : 0;
 	}
 
-	mid = (start + end) / 2;
-	if(tm < arr[mid].time) {
-		return find_prev_key(arr, start, mid, tm);
+	UPDATE_TRACK(track);
+	if(PACKED_LAYOUT(track) && anm_set_track_layout(track, ANM_KEYS_SOA) == -1) {
+		return -1;
 	}
-	if(tm > arr[mid].time) {
-		return find_prev_key(arr, mid, end, tm);
+	if(merge_keys(track, keys, count) == -1) {
+		return -1;
 	}
-	return mid;
+	KEYS_CHANGED(track);
+	return 0;
 }
 
-int anm_set_value(struct anm_track *track, anm_time_t tm, float val)
+void anm_set_track_option(struct anm_track *track, enum anm_track_option opt, int val)
 {
-	struct anm_keyframe key;
-	key.time = tm;
-	key.val = val;
+	if(val) {
+		track->opt |= 1 << opt;
+		KEYS_CHANGED(track);
+	} else {
+		track->opt &= ~(1 << opt);
+		UPDATE_TRACK(track);
+	}
 
-	return anm_set_keyframe(track, &key);
+	if(!(track->opt & (1 << ANM_TRACK_CUBIC_CACHE))) {
+		free(track->coef);
+		track->coef = 0;
+	}
+	if(!(track->opt & (1 << ANM_TRACK_SLERP_CACHE))) {
+		free_slerp_cache(track->slerp);
+		track->slerp = 0;
+	}
 }
 
-float anm_get_value(const struct anm_track *track, anm_time_t tm)
+int anm_get_track_option(const struct anm_track *track, enum anm_track_option opt)
 {
-	int idx0, idx1, last_idx;
-	anm_time_t tstart, tend;
-	float t, dt;
-	float v0, v1, v2, v3;
+	return (track->opt >> opt) & 1;
+}
 
-	if(!track->count) {
-		return track->def_val;
-	}
+void anm_update_track(struct anm_track *track)
+{
+	UPDATE_TRACK(track);
+}
 
-	last_idx = track->count - 1;
+static void update_track(struct anm_track *track)
+{
+	int n, dirty;
+	struct anm_keyframe *tail;
+
+#ifdef ANIM_THREAD_SAFE
+	pthread_mutex_lock(&update_lock);
+	if(!track->dirty) {
+		/* another thread got here first */
+		pthread_mutex_unlock(&update_lock);
+		return;
+	}
+#endif
+	dirty = track->dirty;
+
+	if(track->nsorted < track->count) {
+		/* merge the keys appended since the last update into the sorted part */
+		dirty |= DIRTY_ALL;
+		n = track->count - track->nsorted;
+		if((tail = malloc(n * sizeof *tail))) {
+			copy_keys(tail, track, track->nsorted, n);
+			track->count = track->nsorted;
+			if(merge_keys(track, tail, n) == -1) {
+				track->count += n;
+			}
+			free(tail);
+		}
+	}
+	if((dirty & DIRTY_COEF) && (track->opt & (1 << ANM_TRACK_CUBIC_CACHE))) {
+		calc_cubic_coef(track);
+	}
 
-	tstart = track->keys[0].time;
-	tend = track->keys[last_idx].time;
+	if(dirty & DIRTY_KEYS) {
+		if(NEED_INDEX(track)) {
+			build_index(track);
+		} else if(track->index) {
+			free_index(track->index);
+			track->index = 0;
+		}
+	}
 
-	if(tstart == tend) {
-		return track->keys[0].val;
+	if(track->nsorted == track->count) {
+		dirty = 0;
 	}
+	/* publishes the updated data to threads checking dirty in UPDATE_TRACK */
+	ATOMIC_STORE(&track->dirty, &dirty);
 
-	tm = remap_time[track->extrap](tm, tstart, tend);
+#ifdef ANIM_THREAD_SAFE
+	pthread_mutex_unlock(&update_lock);
+#endif
+}
 
-	idx0 = anm_get_key_interval(track, tm);
-	assert(idx0 >= 0 && idx0 < track->count);
-	idx1 = idx0 + 1;
+/* Precalculates the polynomial coefficients of the cubic interpolation of each
+ * segment (see interp_cubic), for evaluation with Horner's rule.
+ */
+static void calc_cubic_coef(struct anm_track *track)
+{
+	int i, nseg = track->count - 1;
+	float *coef;
 
-	if(idx0 == last_idx) {
-		return track->keys[idx0].val;
+	if(nseg < 1) {
+		free(track->coef);
+		track->coef = 0;
+		return;
+	}
+	if(!(coef = realloc(track->coef, nseg * 4 * sizeof *coef))) {
+		free(track->coef);
+		track->coef = 0;
+		return;
 	}
+	track->coef = coef;
 
-	dt = (float)(track->keys[idx1].time - track->keys[idx0].time);
-	t = (float)(tm - track->keys[idx0].time) / dt;
+	for(i=0; i<nseg; i++) {
+		calc_cubic_seg(track, i);
+	}
+}
 
-	v1 = track->keys[idx0].val;
-	v2 = track->keys[idx1].val;
+static void calc_cubic_seg(struct anm_track *track, int seg)
+{
+	int nseg = track->count - 1;
+	float a, b, c, d, *coef = track->coef + seg * 4;
+
+	b = KEY_VAL(track, seg);
+	c = KEY_VAL(track, seg + 1);
+	a = seg > 0 ? KEY_VAL(track, seg - 1) : b;
+	d = seg + 1 < nseg ? KEY_VAL(track, seg + 2) : c;
+
+	coef[0] = 0.5f * (-a + 3.0f * b - 3.0f * c + d);
+	coef[1] = 0.5f * (2.0f * a - 5.0f * b + 4.0f * c - d);
+	coef[2] = 0.5f * (c - a);
+	coef[3] = b;
+}
 
-	/* get the neigboring values to allow for cubic interpolation */
-	v0 = idx0 > 0 ? track->keys[idx0 - 1].val : v1;
-	v3 = idx1 < last_idx ? track->keys[idx1 + 1].val : v2;
+/* Called after changing the value of keyframe idx in place. Only the cubic
+ * segments which depend on it are recalculated, if the rest are up to date.
+ */
+static void key_value_changed(struct anm_track *track, int idx)
+{
+	int i, nseg;
 
-	return interp[track->interp](v0, v1, v2, v3, t);
-}
+	if(!(track->opt & (1 << ANM_TRACK_CUBIC_CACHE)) || !COEF_VALID(track)) {
+		VALUES_CHANGED(track);
+		return;
+	}
+	track->rev++;
 
+	nseg = track->count - 1;
+	for(i=idx-2; i<=idx+1; i++) {
+		if(i >= 0 && i < nseg) {
+			calc_cubic_seg(track, i);
+		}
+	}
+}
 
-void anm_get_quat(const struct anm_track *xtrk, const struct anm_track *ytrk,
-		const struct anm_track *ztrk, const struct anm_track *wtrk, anm_time_t tm, float *qres)
+static void build_index(struct anm_track *track)
 {
-	int idx0, idx1, last_idx;
-	anm_time_t tstart, tend;
-	float t, dt;
-	cgm_quat q1, q2;
+	struct anm_search_index *index;
 
-	if(!xtrk->count) {
-		qres[0] = xtrk->def_val;
-		qres[1] = ytrk->def_val;
-		qres[2] = ztrk->def_val;
-		qres[3] = wtrk->def_val;
+	free_index(track->index);
+	track->index = 0;
+
+	if(!(index = malloc(sizeof *index))) {
+		return;
+	}
+	index->times = malloc((track->count + 1) * sizeof *index->times);
+	index->idx = malloc((track->count + 1) * sizeof *index->idx);
+	if(!index->times || !index->idx) {
+		free_index(index);
 		return;
 	}
+	index->count = track->count;
+	fill_index(index, track, 0, 1);
+	track->index = index;
+}
 
-	last_idx = xtrk->count - 1;
+/* in-order traversal of the implicit tree, assigning sorted keys to nodes */
+static int fill_index(struct anm_search_index *index, const struct anm_track *track,
+		int kidx, int node)
+{
+	if(node <= index->count) {
+		kidx = fill_index(index, track, kidx, node * 2);
+		index->times[node] = KEY_TIME(track, kidx);
+		index->idx[node] = kidx++;
+		kidx = fill_index(index, track, kidx, node * 2 + 1);
+	}
+	return kidx;
+}
 
-	tstart = xtrk->keys[0].time;
-	tend = xtrk->keys[last_idx].time;
+static void free_index(struct anm_search_index *index)
+{
+	if(index) {
+		free(index->times);
+		free(index->idx);
+		free(index);
+	}
+}
 
-	if(tstart == tend) {
-		qres[0] = xtrk->keys[0].val;
-		qres[1] = ytrk->keys[0].val;
-		qres[2] = ztrk->keys[0].val;
-		qres[3] = wtrk->keys[0].val;
-		return;
+/* branchless search of the index, same results as find_prev_key */
+static int find_prev_index(const struct anm_search_index *index, anm_time_t tm)
+{
+	int res, node = 1;
+
+	while(node <= index->count) {
+#ifdef __GNUC__
+		/* 8 keys per cache line, prefetch the descendants 4 levels down */
+		__builtin_prefetch(index->times + node * 16);
+#endif
+		node = node * 2 + (index->times[node] <= tm);
 	}
 
-	tm = anm_remap_time(xtrk, tm, tstart, tend);
+	/* the path went right past the node we're after, and left once after that.
+	 * Drop the trailing right turns and that last left turn to find the first
+	 * key after tm.
+	 */
+#ifdef __GNUC__
+	node >>= __builtin_ffs(~node);
+#else
+	while(node & 1) node >>= 1;
+	node >>= 1;
+#endif
+
+	res = (node ? index->idx[node] : index->count) - 1;
+
+	/* exact hits on the last keyframe end up in the last interval */
+	if(res == index->count - 1 && res > 0) {
+		res--;
+	}
+	return res;
+}
 
-	idx0 = anm_get_key_interval(xtrk, tm);
-	assert(idx0 >= 0 && idx0 < xtrk->count);
-	idx1 = idx0 + 1;
+/* merges a batch of keys, in any order, into the sorted keys of the track.
+ * In case of duplicate times, the last key in the batch wins.
+ */
+static int merge_keys(struct anm_track *track, const struct anm_keyframe *keys, int count)
+{
+	int i, j, k, n, ndup, newcount;
+	struct anm_keyframe *batch;
 
-	if(idx0 == last_idx) {
-		qres[0] = xtrk->keys[idx0].val;
-		qres[1] = ytrk->keys[idx0].val;
-		qres[2] = ztrk->keys[idx0].val;
-		qres[3] = wtrk->keys[idx0].val;
-		return;
+	if(count <= 0) return 0;
+
+	if(!(batch = malloc(count * 2 * sizeof *batch))) {
+		return -1;
+	}
+	memcpy(batch, keys, count * sizeof *batch);
+	sort_keys(batch, batch + count, count);
+
+	/* drop duplicate times from the batch, keeping the last one */
+	n = 0;
+	for(i=0; i<count; i++) {
+		if(n > 0 && batch[n - 1].time == batch[i].time) {
+			batch[n - 1] = batch[i];
+		} else {
+			batch[n++] = batch[i];
+		}
 	}
 
-	dt = (float)(xtrk->keys[idx1].time - xtrk->keys[idx0].time);
-	t = (float)(tm - xtrk->keys[idx0].time) / dt;
+	/* count keys which only update existing ones */
+	ndup = 0;
+	for(i=0, j=0; i<track->count && j<n;) {
+		anm_time_t tm = KEY_TIME(track, i);
+		if(tm < batch[j].time) {
+			i++;
+		} else if(tm > batch[j].time) {
+			j++;
+		} else {
+			ndup++;
+			i++;
+			j++;
+		}
+	}
 
-	q1.x = xtrk->keys[idx0].val;
-	q1.y = ytrk->keys[idx0].val;
-	q1.z = ztrk->keys[idx0].val;
-	q1.w = wtrk->keys[idx0].val;
+	newcount = track->count + n - ndup;
+	if(resize_keys(track, newcount) == -1) {
+		free(batch);
+		return -1;
+	}
 
-	q2.x = xtrk->keys[idx1].val;
-	q2.y = ytrk->keys[idx1].val;
-	q2.z = ztrk->keys[idx1].val;
-	q2.w = wtrk->keys[idx1].val;
+	/* merge backwards in place */
+	i = track->count - 1;
+	j = n - 1;
+	k = newcount - 1;
+	while(j >= 0) {
+		if(i >= 0 && KEY_TIME(track, i) > batch[j].time) {
+			SET_KEY(track, k, KEY_TIME(track, i), KEY_VAL(track, i));
+			i--;
+		} else {
+			if(i >= 0 && KEY_TIME(track, i) == batch[j].time) {
+				i--;
+			}
+			SET_KEY(track, k, batch[j].time, batch[j].val);
+			j--;
+		}
+		k--;
+	}
+	assert(k == i);
 
-	cgm_qslerp((cgm_quat*)qres, &q1, &q2, t);
+	track->count = track->nsorted = newcount;
+	free(batch);
+	return 0;
 }
 
+/* stable bottom-up merge sort by time, tmp must have room for n keys */
+static void sort_keys(struct anm_keyframe *keys, struct anm_keyframe *tmp, int n)
+{
+	int i, j, k, width, mid, end;
+	struct anm_keyframe *src = keys, *dest = tmp, *swp;
+
+	for(i=1; i<n; i++) {
+		if(keys[i].time < keys[i - 1].time) break;
+	}
+	if(i >= n) return;	/* already sorted */
+
+	for(width=1; width<n; width*=2) {
+		for(i=0; i<n; i+=width*2) {
+			mid = i + width < n ? i + width : n;
+			end = i + width * 2 < n ? i + width * 2 : n;
+
+			j = i;
+			k = mid;
+			while(j < mid && k < end) {
+				*dest++ = src[k].time < src[j].time ? src[k++] : src[j++];
+			}
+			while(j < mid) *dest++ = src[j++];
+			while(k < end) *dest++ = src[k++];
+		}
+		dest -= n;
+		swp = src;
+		src = dest;
+		dest = swp;
+	}
+
+	if(src != keys) {
+		memcpy(keys, src, n * sizeof *keys);
+	}
+}
 
-static float interp_step(float v0, float v1, float v2, float v3, float t)
+static int append_key(struct anm_track *track, const struct anm_keyframe *key)
 {
-	return v1;
+	void *tmp;
+
+	if(track->layout == ANM_KEYS_SOA) {
+		if(!(tmp = lazy_push(track->times, &key->time, sizeof key->time))) {
+			return -1;
+		}
+		track->times = tmp;
+		if(!(tmp = lazy_push(track->vals, &key->val, sizeof key->val))) {
+			track->times = anm_dynarr_pop(track->times);
+			return -1;
+		}
+		track->vals = tmp;
+	} else if(track->layout == ANM_KEYS_SAMPLED) {
+		if(!(tmp = lazy_push(track->vals, &key->val, sizeof key->val))) {
+			return -1;
+		}
+		track->vals = tmp;
+	} else {
+		if(!(tmp = lazy_push(track->keys, key, sizeof *key))) {
+			return -1;
+		}
+		track->keys = tmp;
+	}
+	track->count++;
+	return 0;
 }
 
-static float interp_linear(float v0, float v1, float v2, float v3, float t)
+static int resize_keys(struct anm_track *track, int count)
 {
-	return v1 + (v2 - v1) * t;
+	if(track->layout != ANM_KEYS_AOS) {
+		if(track->layout == ANM_KEYS_SOA) {
+			if(lazy_resize((void**)&track->times, count, sizeof *track->times) == -1) {
+				return -1;
+			}
+		}
+		if(lazy_resize((void**)&track->vals, count, sizeof *track->vals) == -1) {
+			return -1;
+		}
+	} else {
+		if(lazy_resize((void**)&track->keys, count, sizeof *track->keys) == -1) {
+			return -1;
+		}
+	}
+	return 0;
 }
 
-static float interp_cubic(float a, float b, float c, float d, float t)
+/* Key arrays of empty tracks are not allocated, to avoid paying for channels
+ * which are never animated. These two allocate them on demand.
+ */
+static void *lazy_push(void *da, const void *item, int szelem)
 {
-	float x, y, z, w;
-	float tsq = t * t;
+	if(!da && !(da = anm_dynarr_alloc(0, szelem))) {
+		return 0;
+	}
+	return anm_dynarr_push(da, (void*)item);
+}
 
-	x = -a + 3.0 * b - 3.0 * c + d;
-	y = 2.0 * a - 5.0 * b + 4.0 * c - d;
-	z = c - a;
-	w = 2.0 * b;
+static int lazy_resize(void **da, int count, int szelem)
+{
+	void *tmp;
 
-	return 0.5 * (x * tsq * t + y * tsq + z * t + w);
+	if(*da) {
+		tmp = anm_dynarr_resize(*da, count);
+	} else {
+		tmp = anm_dynarr_alloc(count, szelem);
+	}
+	if(!tmp) {
+		return -1;
+	}
+	*da = tmp;
+	return 0;
+}
+
+static void copy_keys(struct anm_keyframe *dest, const struct anm_track *track, int start, int count)
+{
+	int i;
+
+	if(track->layout == ANM_KEYS_AOS) {
+		memcpy(dest, track->keys + start, count * sizeof *dest);
+	} else {
+		for(i=0; i<count; i++) {
+			dest[i].time = KEY_TIME(track, start + i);
+			dest[i].val = KEY_VAL(track, start + i);
+		}
+	}
+}
+
+struct anm_keyframe *anm_get_keyframe(const struct anm_track *track, int idx)
+{
+	struct anm_keyframe *key;
+
+	UPDATE_TRACK(track);
+
+	if(idx < 0 || idx >= track->count) {
+		return 0;
+	}
+	if(track->layout != ANM_KEYS_AOS) {
+		/* there are no keyframe structures to point to, return a copy */
+		key = (struct anm_keyframe*)&track->tmpkey;
+		key->time = KEY_TIME(track, idx);
+		key->val = KEY_VAL(track, idx);
+		return key;
+	}
+	return track->keys + idx;
+}
+
+int anm_get_keyframe_copy(const struct anm_track *track, int idx, struct anm_keyframe *key)
+{
+	UPDATE_TRACK(track);
+
+	if(idx < 0 || idx >= track->count) {
+		return -1;
+	}
+	key->time = KEY_TIME(track, idx);
+	key->val = KEY_VAL(track, idx);
+	return 0;
+}
+
+int anm_get_key_interval(const struct anm_track *track, anm_time_t tm)
+{
+	UPDATE_TRACK(track);
+	return key_interval(track, tm, track->layout);
+}
+
+static FORCE_INLINE int key_interval(const struct anm_track *track, anm_time_t tm,
+		enum anm_key_layout layout)
+{
+	int idx, last;
+
+	if(!track->count || tm < LKEY_TIME(track, layout, 0)) {
+		return -1;
+	}
+
+	last = track->count - 1;
+	if(tm > LKEY_TIME(track, layout, last)) {
+		return last;
+	}
+
+	if(layout == ANM_KEYS_SAMPLED) {
+		idx = (tm - track->tstart) / track->period;
+		/* exact hits on the last keyframe end up in the last interval */
+		return idx == last && idx > 0 ? idx - 1 : idx;
+	}
+	if(layout == ANM_KEYS_QUANTIZED) {
+		idx = find_prev_quant(track->quant, track->count, tm);
+		return idx == last && idx > 0 ? idx - 1 : idx;
+	}
+	if(track->index) {
+		return find_prev_index(track->index, tm);
+	}
+	if(layout == ANM_KEYS_SOA) {
+		return find_prev_time(track->times, track->count, tm);
+	}
+	return find_prev_key(track->keys, 0, last, tm);
+}
+
+static int find_prev_key(const struct anm_keyframe *arr, int start, int end, anm_time_t tm)
+{
+	int mid;
+
+	if(end - start <= 1) {
+		return start;
+	}
+
+	mid = (start + end) / 2;
+	if(tm < arr[mid].time) {
+		return find_prev_key(arr, start, mid, tm);
+	}
+	if(tm > arr[mid].time) {
+		return find_prev_key(arr, mid, end, tm);
+	}
+	return mid;
+}
+
+/* Searches a contiguous array of key times, with the same results as
+ * find_prev_key. The bisection is branchless, and the last few steps are
+ * replaced by a linear count which the compiler can vectorize.
+ */
+#define LINEAR_SEARCH_MAX	16
+
+static int find_prev_time(const anm_time_t *times, int count, anm_time_t tm)
+{
+	int i, half, n = count;
+	const anm_time_t *base = times;
+	int res;
+
+	while(n > LINEAR_SEARCH_MAX) {
+		half = n / 2;
+		base = base[half] <= tm ? base + half : base;
+		n -= half;
+	}
+
+	res = base - times - 1;
+	for(i=0; i<n; i++) {
+		res += base[i] <= tm;
+	}
+
+	/* exact hits on the last keyframe end up in the last interval */
+	if(res == count - 1 && res > 0) {
+		res--;
+	}
+	return res;
+}
+
+static struct anm_quant_keys *alloc_quant(int count, int val_bits, int wide_times)
+{
+	int nblocks = (count + QUANT_BLOCK_SIZE - 1) >> QUANT_BLOCK_SHIFT;
+	size_t hdrsz, basesz, toffsz, valsz;
+	struct anm_quant_keys *q;
+	char *ptr;
+
+	/* everything goes in one block, in order of decreasing alignment */
+	hdrsz = (sizeof *q + sizeof(anm_time_t) - 1) / sizeof(anm_time_t) * sizeof(anm_time_t);
+	basesz = nblocks * sizeof(anm_time_t);
+	toffsz = count * (wide_times ? sizeof *q->toffs32 : sizeof *q->toffs);
+	valsz = count * (val_bits > 8 ? sizeof *q->vals : sizeof *q->vals8);
+
+	if(!(q = malloc(hdrsz + basesz + toffsz + valsz))) {
+		return 0;
+	}
+	memset(q, 0, sizeof *q);
+	q->val_bits = val_bits;
+	q->wide_times = wide_times;
+
+	ptr = (char*)q + hdrsz;
+	q->base = (anm_time_t*)ptr;
+	ptr += basesz;
+	if(wide_times) {
+		q->toffs32 = (unsigned int*)ptr;
+	} else {
+		q->toffs = (unsigned short*)ptr;
+	}
+	ptr += toffsz;
+	if(val_bits > 8) {
+		q->vals = (unsigned short*)ptr;
+	} else {
+		q->vals8 = (unsigned char*)ptr;
+	}
+	return q;
+}
+
+static struct anm_quant_keys *copy_quant(const struct anm_quant_keys *q, int count)
+{
+	int nblocks = (count + QUANT_BLOCK_SIZE - 1) >> QUANT_BLOCK_SHIFT;
+	struct anm_quant_keys *res;
+
+	if(!(res = alloc_quant(count, q->val_bits, q->wide_times))) {
+		return 0;
+	}
+	res->vmin = q->vmin;
+	res->vscale = q->vscale;
+	memcpy(res->base, q->base, nblocks * sizeof *res->base);
+	if(q->wide_times) {
+		memcpy(res->toffs32, q->toffs32, count * sizeof *res->toffs32);
+	} else {
+		memcpy(res->toffs, q->toffs, count * sizeof *res->toffs);
+	}
+	if(q->val_bits > 8) {
+		memcpy(res->vals, q->vals, count * sizeof *res->vals);
+	} else {
+		memcpy(res->vals8, q->vals8, count * sizeof *res->vals8);
+	}
+	return res;
+}
+
+/* Finds the last key at or before tm, by searching the block base times
+ * first, and then counting the keys of that block with time offsets up to tm,
+ * both without branches like find_prev_time. tm must not be before the first
+ * key.
+ */
+static int find_prev_quant(const struct anm_quant_keys *q, int count, anm_time_t tm)
+{
+	int i, half, n, start, res;
+	const anm_time_t *base = q->base;
+	anm_time_t offs;
+
+	n = ((count - 1) >> QUANT_BLOCK_SHIFT) + 1;
+	while(n > 1) {
+		half = n / 2;
+		base = base[half] <= tm ? base + half : base;
+		n -= half;
+	}
+
+	offs = tm - *base;
+	start = (base - q->base) << QUANT_BLOCK_SHIFT;
+	n = count - start < QUANT_BLOCK_SIZE ? count - start : QUANT_BLOCK_SIZE;
+
+	res = start - 1;
+	if(q->wide_times) {
+		const unsigned int *toffs = q->toffs32 + start;
+		for(i=0; i<n; i++) {
+			res += toffs[i] <= offs;
+		}
+	} else {
+		const unsigned short *toffs = q->toffs + start;
+		for(i=0; i<n; i++) {
+			res += toffs[i] <= offs;
+		}
+	}
+	return res;
+}
+
+void anm_init_cursor(struct anm_cursor *cur)
+{
+	cur->idx = -1;
+}
+
+int anm_get_key_interval_cursor(const struct anm_track *track, anm_time_t tm,
+		struct anm_cursor *cur)
+{
+	UPDATE_TRACK(track);
+	return key_interval_cursor(track, tm, cur, track->layout);
+}
+
+static FORCE_INLINE int key_interval_cursor(const struct anm_track *track, anm_time_t tm,
+		struct anm_cursor *cur, enum anm_key_layout layout)
+{
+	int idx = cur->idx;
+
+	if(idx >= 0 && idx < track->count) {
+		if(key_in_interval(track, idx, tm, layout)) {
+			return idx;
+		}
+		/* try the next or the previous interval before falling back to a search */
+		idx = tm > LKEY_TIME(track, layout, idx) ? idx + 1 : idx - 1;
+		if(key_in_interval(track, idx, tm, layout)) {
+			cur->idx = idx;
+			return idx;
+		}
+	}
+
+	cur->idx = key_interval(track, tm, layout);
+	return cur->idx;
+}
+
+/* returns true if anm_get_key_interval would return idx for this time */
+static FORCE_INLINE int key_in_interval(const struct anm_track *track, int idx, anm_time_t tm,
+		enum anm_key_layout layout)
+{
+	int last = track->count - 1;
+
+	if(idx < 0 || idx > last || tm < LKEY_TIME(track, layout, idx)) {
+		return 0;
+	}
+	if(idx == last) {
+		return last == 0 || tm > LKEY_TIME(track, layout, last);
+	}
+	/* exact hits on the last keyframe end up in the last interval */
+	if(idx + 1 == last) {
+		return tm <= LKEY_TIME(track, layout, last);
+	}
+	return tm < LKEY_TIME(track, layout, idx + 1);
+}
+
+int anm_set_value(struct anm_track *track, anm_time_t tm, float val)
+{
+	struct anm_keyframe key;
+	key.time = tm;
+	key.val = val;
+
+	return anm_set_keyframe(track, &key);
+}
+
+float anm_get_value(const struct anm_track *track, anm_time_t tm)
+{
+	return eval_track(track, tm, 0);
+}
+
+float anm_get_value_cursor(const struct anm_track *track, anm_time_t tm,
+		struct anm_cursor *cur)
+{
+	return eval_track(track, tm, cur);
+}
+
+static float eval_track(const struct anm_track *track, anm_time_t tm, struct anm_cursor *cur)
+{
+	UPDATE_TRACK(track);
+
+	switch(track->layout) {
+	case ANM_KEYS_AOS:
+		return eval_keys(track, tm, cur, ANM_KEYS_AOS);
+	case ANM_KEYS_SOA:
+		return eval_keys(track, tm, cur, ANM_KEYS_SOA);
+	case ANM_KEYS_SAMPLED:
+		return eval_keys(track, tm, cur, ANM_KEYS_SAMPLED);
+	default:
+		break;
+	}
+	return eval_keys(track, tm, cur, ANM_KEYS_QUANTIZED);
+}
+
+static FORCE_INLINE float eval_keys(const struct anm_track *track, anm_time_t tm,
+		struct anm_cursor *cur, enum anm_key_layout layout)
+{
+	int idx0, idx1, last_idx;
+	anm_time_t tstart, tend;
+	float t, dt;
+	float v0, v1, v2, v3;
+
+	if(!track->count) {
+		return track->def_val;
+	}
+
+	last_idx = track->count - 1;
+
+	tstart = LKEY_TIME(track, layout, 0);
+	tend = LKEY_TIME(track, layout, last_idx);
+
+	if(tstart == tend) {
+		return LKEY_VAL(track, layout, 0);
+	}
+
+	tm = remap(track->extrap, tm, tstart, tend);
+
+	idx0 = cur ? key_interval_cursor(track, tm, cur, layout) : key_interval(track, tm, layout);
+	assert(idx0 >= 0 && idx0 < track->count);
+	idx1 = idx0 + 1;
+
+	if(idx0 == last_idx) {
+		return LKEY_VAL(track, layout, idx0);
+	}
+
+	dt = (float)(LKEY_TIME(track, layout, idx1) - LKEY_TIME(track, layout, idx0));
+	t = (float)(tm - LKEY_TIME(track, layout, idx0)) / dt;
+
+	if(track->interp == ANM_INTERP_CUBIC && track->coef) {
+		const float *c = track->coef + idx0 * 4;
+		return ((c[0] * t + c[1]) * t + c[2]) * t + c[3];
+	}
+
+	v1 = LKEY_VAL(track, layout, idx0);
+	v2 = LKEY_VAL(track, layout, idx1);
+
+	/* get the neigboring values to allow for cubic interpolation */
+	v0 = idx0 > 0 ? LKEY_VAL(track, layout, idx0 - 1) : v1;
+	v3 = idx1 < last_idx ? LKEY_VAL(track, layout, idx1 + 1) : v2;
+
+	return interpolate(track->interp, v0, v1, v2, v3, t);
+}
+
+
+/* number of samples processed at a time by anm_get_values */
+#define BATCH_SIZE	64
+
+void anm_get_values(const struct anm_track *track, const anm_time_t *times, int n, float *out)
+{
+	UPDATE_TRACK(track);
+
+	switch(track->layout) {
+	case ANM_KEYS_AOS:
+		eval_batch(track, times, n, out, ANM_KEYS_AOS);
+		break;
+	case ANM_KEYS_SOA:
+		eval_batch(track, times, n, out, ANM_KEYS_SOA);
+		break;
+	case ANM_KEYS_SAMPLED:
+		eval_batch(track, times, n, out, ANM_KEYS_SAMPLED);
+		break;
+	default:
+		eval_batch(track, times, n, out, ANM_KEYS_QUANTIZED);
+	}
+}
+
+static FORCE_INLINE void eval_batch(const struct anm_track *track, const anm_time_t *times,
+		int n, float *out, enum anm_key_layout layout)
+{
+	int i, bsz, idx0, idx1, last_idx, use_coef;
+	anm_time_t tstart, tend, prev_tm;
+	anm_time_t tm[BATCH_SIZE];
+	float v0[BATCH_SIZE], v1[BATCH_SIZE], v2[BATCH_SIZE], v3[BATCH_SIZE], t[BATCH_SIZE];
+
+	if(!track->count) {
+		for(i=0; i<n; i++) {
+			out[i] = track->def_val;
+		}
+		return;
+	}
+
+	last_idx = track->count - 1;
+
+	tstart = LKEY_TIME(track, layout, 0);
+	tend = LKEY_TIME(track, layout, last_idx);
+
+	if(tstart == tend) {
+		for(i=0; i<n; i++) {
+			out[i] = LKEY_VAL(track, layout, 0);
+		}
+		return;
+	}
+
+	use_coef = track->interp == ANM_INTERP_CUBIC && track->coef;
+
+	idx0 = -1;
+	prev_tm = ANM_TIME_MIN;
+
+	while(n > 0) {
+		bsz = n > BATCH_SIZE ? BATCH_SIZE : n;
+
+		remap_times(track, times, tm, bsz, tstart, tend);
+
+		/* find the intervals and gather the interpolation inputs. Sorted runs of
+		 * sample times are resolved by sweeping forward from the previous interval.
+		 */
+		for(i=0; i<bsz; i++) {
+			if(idx0 >= 0 && tm[i] >= prev_tm) {
+				idx0 = next_interval(track, idx0, tm[i], layout);
+			} else {
+				idx0 = key_interval(track, tm[i], layout);
+			}
+			assert(idx0 >= 0 && idx0 < track->count);
+			prev_tm = tm[i];
+
+			if(idx0 == last_idx) {
+				/* degenerate interval, every interpolator yields v1 */
+				v0[i] = v1[i] = v2[i] = v3[i] = LKEY_VAL(track, layout, idx0);
+				t[i] = 0.0f;
+				continue;
+			}
+			idx1 = idx0 + 1;
+
+			t[i] = (float)(tm[i] - LKEY_TIME(track, layout, idx0)) /
+				(float)(LKEY_TIME(track, layout, idx1) - LKEY_TIME(track, layout, idx0));
+
+			if(use_coef) {
+				/* gather the cubic coefficients instead of the values */
+				const float *c = track->coef + idx0 * 4;
+				v0[i] = c[0];
+				v1[i] = c[1];
+				v2[i] = c[2];
+				v3[i] = c[3];
+				continue;
+			}
+
+			v1[i] = LKEY_VAL(track, layout, idx0);
+			v2[i] = LKEY_VAL(track, layout, idx1);
+			v0[i] = idx0 > 0 ? LKEY_VAL(track, layout, idx0 - 1) : v1[i];
+			v3[i] = idx1 < last_idx ? LKEY_VAL(track, layout, idx1 + 1) : v2[i];
+		}
+
+		/* branch-free interpolation loops, for the compiler to vectorize */
+		switch(track->interp) {
+		case ANM_INTERP_STEP:
+			for(i=0; i<bsz; i++) {
+				out[i] = v1[i];
+			}
+			break;
+
+		case ANM_INTERP_LINEAR:
+			for(i=0; i<bsz; i++) {
+				out[i] = v1[i] + (v2[i] - v1[i]) * t[i];
+			}
+			break;
+
+		case ANM_INTERP_CUBIC:
+			if(use_coef) {
+				for(i=0; i<bsz; i++) {
+					out[i] = ((v0[i] * t[i] + v1[i]) * t[i] + v2[i]) * t[i] + v3[i];
+				}
+			} else {
+				for(i=0; i<bsz; i++) {
+					out[i] = interp_cubic(v0[i], v1[i], v2[i], v3[i], t[i]);
+				}
+			}
+			break;
+		}
+
+		times += bsz;
+		out += bsz;
+		n -= bsz;
+	}
+}
+
+/* advances a known interval forward to the one containing a later time, and
+ * falls back to a search if it's not within a few keyframes.
+ */
+#define SWEEP_MAX_STEPS	8
+
+static FORCE_INLINE int next_interval(const struct anm_track *track, int idx, anm_time_t tm,
+		enum anm_key_layout layout)
+{
+	int i;
+
+	for(i=0; i<SWEEP_MAX_STEPS; i++) {
+		if(key_in_interval(track, idx, tm, layout)) {
+			return idx;
+		}
+		if(++idx >= track->count) break;
+	}
+	return key_interval(track, tm, layout);
+}
+
+static void remap_times(const struct anm_track *track, const anm_time_t *times, anm_time_t *res,
+		int n, anm_time_t start, anm_time_t end)
+{
+	int i;
+
+	switch(track->extrap) {
+	case ANM_EXTRAP_EXTEND:
+		for(i=0; i<n; i++) {
+			res[i] = remap_extend(times[i], start, end);
+		}
+		break;
+
+	case ANM_EXTRAP_CLAMP:
+		for(i=0; i<n; i++) {
+			res[i] = remap_clamp(times[i], start, end);
+		}
+		break;
+
+	case ANM_EXTRAP_REPEAT:
+		for(i=0; i<n; i++) {
+			res[i] = remap_repeat(times[i], start, end);
+		}
+		break;
+
+	case ANM_EXTRAP_PINGPONG:
+		for(i=0; i<n; i++) {
+			res[i] = remap_pingpong(times[i], start, end);
+		}
+		break;
+	}
+}
+
+
+void anm_get_quat(const struct anm_track *xtrk, const struct anm_track *ytrk,
+		const struct anm_track *ztrk, const struct anm_track *wtrk, anm_time_t tm, float *qres)
+{
+	eval_quat(xtrk, ytrk, ztrk, wtrk, tm, qres, 0);
+}
+
+void anm_get_quat_cursor(const struct anm_track *xtrk, const struct anm_track *ytrk,
+		const struct anm_track *ztrk, const struct anm_track *wtrk, anm_time_t tm,
+		float *qres, struct anm_cursor *cur)
+{
+	eval_quat(xtrk, ytrk, ztrk, wtrk, tm, qres, cur);
+}
+
+static void eval_quat(const struct anm_track *xtrk, const struct anm_track *ytrk,
+		const struct anm_track *ztrk, const struct anm_track *wtrk, anm_time_t tm,
+		float *qres, struct anm_cursor *cur)
+{
+	int idx0, idx1, last_idx;
+	anm_time_t tstart, tend;
+	float t, dt;
+	cgm_quat q1, q2;
+
+	UPDATE_TRACK(xtrk);
+	UPDATE_TRACK(ytrk);
+	UPDATE_TRACK(ztrk);
+	UPDATE_TRACK(wtrk);
+
+	if(!xtrk->count) {
+		qres[0] = xtrk->def_val;
+		qres[1] = ytrk->def_val;
+		qres[2] = ztrk->def_val;
+		qres[3] = wtrk->def_val;
+		return;
+	}
+
+	last_idx = xtrk->count - 1;
+
+	tstart = KEY_TIME(xtrk, 0);
+	tend = KEY_TIME(xtrk, last_idx);
+
+	if(tstart == tend) {
+		qres[0] = KEY_VAL(xtrk, 0);
+		qres[1] = KEY_VAL(ytrk, 0);
+		qres[2] = KEY_VAL(ztrk, 0);
+		qres[3] = KEY_VAL(wtrk, 0);
+		return;
+	}
+
+	tm = anm_remap_time(xtrk, tm, tstart, tend);
+
+	idx0 = cur ? anm_get_key_interval_cursor(xtrk, tm, cur) : anm_get_key_interval(xtrk, tm);
+	assert(idx0 >= 0 && idx0 < xtrk->count);
+	idx1 = idx0 + 1;
+
+	if(idx0 == last_idx) {
+		qres[0] = KEY_VAL(xtrk, idx0);
+		qres[1] = KEY_VAL(ytrk, idx0);
+		qres[2] = KEY_VAL(ztrk, idx0);
+		qres[3] = KEY_VAL(wtrk, idx0);
+		return;
+	}
+
+	dt = (float)(KEY_TIME(xtrk, idx1) - KEY_TIME(xtrk, idx0));
+	t = (float)(tm - KEY_TIME(xtrk, idx0)) / dt;
+
+	q1.x = KEY_VAL(xtrk, idx0);
+	q1.y = KEY_VAL(ytrk, idx0);
+	q1.z = KEY_VAL(ztrk, idx0);
+	q1.w = KEY_VAL(wtrk, idx0);
+
+	q2.x = KEY_VAL(xtrk, idx1);
+	q2.y = KEY_VAL(ytrk, idx1);
+	q2.z = KEY_VAL(ztrk, idx1);
+	q2.w = KEY_VAL(wtrk, idx1);
+
+	if(xtrk->opt & (1 << ANM_TRACK_SLERP_CACHE)) {
+		struct anm_slerp_cache *sc;
+
+		ATOMIC_LOAD(&xtrk->slerp, &sc);
+		if(!slerp_cache_valid(sc, xtrk, ytrk, ztrk, wtrk)) {
+			sc = update_slerp_cache(xtrk, ytrk, ztrk, wtrk);
+		}
+		if(sc) {
+			struct slerp_seg *seg = sc->seg + idx0;
+			float a, b;
+
+			if(seg->inv_sin == 0.0f) {
+				a = 1.0f - t;
+				b = t;
+			} else {
+				a = sinf((1.0f - t) * seg->angle) * seg->inv_sin;
+				b = sinf(t * seg->angle) * seg->inv_sin;
+			}
+			a *= seg->sign;
+
+			qres[0] = q1.x * a + q2.x * b;
+			qres[1] = q1.y * a + q2.y * b;
+			qres[2] = q1.z * a + q2.z * b;
+			qres[3] = q1.w * a + q2.w * b;
+			return;
+		}
+	}
+
+	cgm_qslerp((cgm_quat*)qres, &q1, &q2, t);
+}
+
+static int slerp_cache_valid(const struct anm_slerp_cache *sc, const struct anm_track *xtrk,
+		const struct anm_track *ytrk, const struct anm_track *ztrk, const struct anm_track *wtrk)
+{
+	if(!sc) return 0;
+
+	return sc->trk[0] == xtrk && sc->trk[1] == ytrk && sc->trk[2] == ztrk && sc->trk[3] == wtrk &&
+		sc->rev[0] == xtrk->rev && sc->rev[1] == ytrk->rev && sc->rev[2] == ztrk->rev &&
+		sc->rev[3] == wtrk->rev && sc->nseg == xtrk->count - 1;
+}
+
+/* Precalculates the parts of the slerp between the ends of each segment which
+ * don't depend on the interpolation parameter: the angle between them, the
+ * reciprocal of its sine, and the sign flip for taking the shortest arc.
+ * Returns the up to date cache, or null if it can't be allocated.
+ *
+ * Readers use the cache without locking, so it's built in a new allocation,
+ * and published with a release store once it's complete. Threads evaluating
+ * the track may still be using the cache it replaces, but keyframes are not
+ * modified during evaluation. So by the time the next edit makes this one
+ * stale, they're done with it, and the next rebuild frees it. This assumes
+ * xtrk is always evaluated with the same y, z and w tracks, as in a node.
+ */
+static struct anm_slerp_cache *update_slerp_cache(const struct anm_track *xtrk,
+		const struct anm_track *ytrk, const struct anm_track *ztrk, const struct anm_track *wtrk)
+{
+	int i, nseg;
+	float dot, angle, sin_angle;
+	struct anm_slerp_cache *sc, *prev;
+	struct slerp_seg *seg;
+
+#ifdef ANIM_THREAD_SAFE
+	pthread_mutex_lock(&update_lock);
+#endif
+	/* only stored with the lock held, no other thread can change it now */
+	prev = xtrk->slerp;
+	if(slerp_cache_valid(prev, xtrk, ytrk, ztrk, wtrk)) {
+		sc = prev;
+		goto end;
+	}
+
+	nseg = xtrk->count - 1;
+	if(!(sc = malloc(sizeof *sc + nseg * sizeof *seg))) {
+		goto end;
+	}
+	sc->seg = seg = (struct slerp_seg*)(sc + 1);
+
+	for(i=0; i<nseg; i++) {
+		dot = KEY_VAL(xtrk, i) * KEY_VAL(xtrk, i + 1) + KEY_VAL(ytrk, i) * KEY_VAL(ytrk, i + 1) +
+			KEY_VAL(ztrk, i) * KEY_VAL(ztrk, i + 1) + KEY_VAL(wtrk, i) * KEY_VAL(wtrk, i + 1);
+
+		/* interpolate across the shortest arc */
+		if(dot < 0.0f) {
+			seg->sign = -1.0f;
+			dot = -dot;
+		} else {
+			seg->sign = 1.0f;
+		}
+		if(dot > 1.0f) dot = 1.0f;
+
+		angle = acos(dot);
+		sin_angle = sin(angle);
+
+		seg->angle = angle;
+		seg->inv_sin = sin_angle == 0.0f ? 0.0f : 1.0f / sin_angle;
+		seg++;
+	}
+
+	sc->nseg = nseg;
+	sc->trk[0] = xtrk;
+	sc->trk[1] = ytrk;
+	sc->trk[2] = ztrk;
+	sc->trk[3] = wtrk;
+	sc->rev[0] = xtrk->rev;
+	sc->rev[1] = ytrk->rev;
+	sc->rev[2] = ztrk->rev;
+	sc->rev[3] = wtrk->rev;
+
+	if(prev) {
+		free(prev->prev);
+		prev->prev = 0;
+	}
+	sc->prev = prev;
+	ATOMIC_STORE(&((struct anm_track*)xtrk)->slerp, &sc);
+
+end:
+#ifdef ANIM_THREAD_SAFE
+	pthread_mutex_unlock(&update_lock);
+#endif
+	return sc;
+}
+
+static void free_slerp_cache(struct anm_slerp_cache *sc)
+{
+	if(sc) {
+		free(sc->prev);
+		free(sc);
+	}
+}
+
+/* ---- 3D vector tracks ---- */
+
+int anm_init_vec3_track(struct anm_vec3_track *track)
+{
+	/* times and keys are allocated when the first keyframe is added */
+	memset(track, 0, sizeof *track);
+
+	track->interp = ANM_INTERP_LINEAR;
+	track->extrap = ANM_EXTRAP_CLAMP;
+	return 0;
+}
+
+void anm_destroy_vec3_track(struct anm_vec3_track *track)
+{
+	if(!track->times_shared) {
+		anm_dynarr_free(track->times);
+	}
+	anm_dynarr_free(track->keys);
+}
+
+int anm_copy_vec3_track(struct anm_vec3_track *dest, const struct anm_vec3_track *src)
+{
+	anm_time_t *times;
+	struct anm_vec3_key *keys;
+
+	if(!src->count) {
+		times = 0;
+		keys = 0;
+	} else {
+		if(!(times = anm_dynarr_alloc(src->count, sizeof *times))) {
+			return -1;
+		}
+		if(!(keys = anm_dynarr_alloc(src->count, sizeof *keys))) {
+			anm_dynarr_free(times);
+			return -1;
+		}
+		memcpy(times, src->times, src->count * sizeof *times);
+		memcpy(keys, src->keys, src->count * sizeof *keys);
+	}
+
+	anm_destroy_vec3_track(dest);
+	*dest = *src;
+	dest->times = times;
+	dest->times_shared = 0;
+	dest->keys = keys;
+	return 0;
+}
+
+void anm_set_vec3_track_interpolator(struct anm_vec3_track *track, enum anm_interpolator in)
+{
+	track->interp = in;
+}
+
+void anm_set_vec3_track_extrapolator(struct anm_vec3_track *track, enum anm_extrapolator ex)
+{
+	track->extrap = ex;
+}
+
+void anm_set_vec3_track_default(struct anm_vec3_track *track, const float *v)
+{
+	memcpy(track->def_val, v, sizeof track->def_val);
+}
+
+int anm_set_vec3_keyframe(struct anm_vec3_track *track, anm_time_t tm, const float *v)
+{
+	struct anm_vec3_key key;
+
+	memcpy(key.v, v, 3 * sizeof *key.v);
+	key.v[3] = 0.0f;
+
+	if(insert_key(&track->times, &track->times_shared, (void**)&track->keys, sizeof key,
+				track->count, tm, &key) == -1) {
+		return -1;
+	}
+	track->count = anm_dynarr_size(track->times);
+	return 0;
+}
+
+int anm_get_vec3_keyframe(const struct anm_vec3_track *track, int idx, anm_time_t *tm, float *v)
+{
+	if(idx < 0 || idx >= track->count) {
+		return -1;
+	}
+	if(tm) *tm = track->times[idx];
+	if(v) memcpy(v, track->keys[idx].v, 3 * sizeof *v);
+	return 0;
+}
+
+int anm_get_vec3_key_interval(const struct anm_vec3_track *track, anm_time_t tm)
+{
+	return times_interval(track->times, track->count, tm);
+}
+
+void anm_get_vec3_value(const struct anm_vec3_track *track, anm_time_t tm, float *res)
+{
+	eval_vec3_track(track, tm, res, 0);
+}
+
+void anm_get_vec3_value_cursor(const struct anm_vec3_track *track, anm_time_t tm,
+		float *res, struct anm_cursor *cur)
+{
+	eval_vec3_track(track, tm, res, cur);
+}
+
+static void eval_vec3_track(const struct anm_vec3_track *track, anm_time_t tm, float *res,
+		struct anm_cursor *cur)
+{
+	int i, idx, last_idx;
+	anm_time_t tstart, tend;
+	float t, tsq, x, y, z, w, v[4];
+	const float *v0, *v1, *v2, *v3;
+
+	if(!track->count) {
+		memcpy(res, track->def_val, sizeof track->def_val);
+		return;
+	}
+
+	last_idx = track->count - 1;
+
+	tstart = track->times[0];
+	tend = track->times[last_idx];
+
+	if(tstart == tend) {
+		memcpy(res, track->keys[0].v, 3 * sizeof *res);
+		return;
+	}
+
+	tm = remap(track->extrap, tm, tstart, tend);
+
+	idx = cur ? times_interval_cursor(track->times, track->count, tm, cur) :
+		times_interval(track->times, track->count, tm);
+	assert(idx >= 0 && idx < track->count);
+
+	v1 = track->keys[idx].v;
+	if(idx == last_idx || track->interp == ANM_INTERP_STEP) {
+		memcpy(res, v1, 3 * sizeof *res);
+		return;
+	}
+	v2 = track->keys[idx + 1].v;
+
+	t = (float)(tm - track->times[idx]) / (float)(track->times[idx + 1] - track->times[idx]);
+
+	/* all four lanes are interpolated with the same operations, so that the
+	 * compiler can turn each loop into a few SIMD instructions.
+	 */
+	if(track->interp == ANM_INTERP_CUBIC) {
+		v0 = idx > 0 ? track->keys[idx - 1].v : v1;
+		v3 = idx + 1 < last_idx ? track->keys[idx + 2].v : v2;
+
+		tsq = t * t;
+		for(i=0; i<4; i++) {
+			x = -v0[i] + 3.0f * v1[i] - 3.0f * v2[i] + v3[i];
+			y = 2.0f * v0[i] - 5.0f * v1[i] + 4.0f * v2[i] - v3[i];
+			z = v2[i] - v0[i];
+			w = 2.0f * v1[i];
+			v[i] = 0.5f * (x * tsq * t + y * tsq + z * t + w);
+		}
+	} else {
+		for(i=0; i<4; i++) {
+			v[i] = v1[i] + (v2[i] - v1[i]) * t;
+		}
+	}
+	res[0] = v[0];
+	res[1] = v[1];
+	res[2] = v[2];
+}
+
+
+/* ---- quaternion rotation tracks ---- */
+
+int anm_init_quat_track(struct anm_quat_track *track)
+{
+	/* times and keys are allocated when the first keyframe is added */
+	memset(track, 0, sizeof *track);
+
+	track->def_val[3] = 1.0f;
+	track->interp = ANM_INTERP_LINEAR;
+	track->extrap = ANM_EXTRAP_CLAMP;
+	return 0;
+}
+
+void anm_destroy_quat_track(struct anm_quat_track *track)
+{
+	if(!track->times_shared) {
+		anm_dynarr_free(track->times);
+	}
+	anm_dynarr_free(track->keys);
+}
+
+int anm_copy_quat_track(struct anm_quat_track *dest, const struct anm_quat_track *src)
+{
+	anm_time_t *times;
+	struct anm_quat_key *keys;
+
+	if(!src->count) {
+		times = 0;
+		keys = 0;
+	} else {
+		if(!(times = anm_dynarr_alloc(src->count, sizeof *times))) {
+			return -1;
+		}
+		if(!(keys = anm_dynarr_alloc(src->count, sizeof *keys))) {
+			anm_dynarr_free(times);
+			return -1;
+		}
+		memcpy(times, src->times, src->count * sizeof *times);
+		memcpy(keys, src->keys, src->count * sizeof *keys);
+	}
+
+	anm_destroy_quat_track(dest);
+	*dest = *src;
+	dest->times = times;
+	dest->times_shared = 0;
+	dest->keys = keys;
+	return 0;
+}
+
+void anm_set_quat_track_interpolator(struct anm_quat_track *track, enum anm_interpolator in)
+{
+	track->interp = in;
+}
+
+void anm_set_quat_track_extrapolator(struct anm_quat_track *track, enum anm_extrapolator ex)
+{
+	track->extrap = ex;
+}
+
+void anm_set_quat_track_default(struct anm_quat_track *track, const float *q)
+{
+	memcpy(track->def_val, q, sizeof track->def_val);
+}
+
+int anm_set_quat_keyframe(struct anm_quat_track *track, anm_time_t tm, const float *q)
+{
+	int idx;
+	struct anm_quat_key key;
+
+	memset(&key, 0, sizeof key);
+	memcpy(key.q, q, sizeof key.q);
+
+	idx = insert_key(&track->times, &track->times_shared, (void**)&track->keys, sizeof key,
+			track->count, tm, &key);
+	if(idx == -1) {
+		return -1;
+	}
+	track->count = anm_dynarr_size(track->times);
+
+	/* update the slerp constants of the segments on either side of the key */
+	if(idx > 0) {
+		calc_quat_seg(track->keys + idx - 1, track->keys + idx);
+	}
+	if(idx < track->count - 1) {
+		calc_quat_seg(track->keys + idx, track->keys + idx + 1);
+	}
+	return 0;
+}
+
+int anm_get_quat_keyframe(const struct anm_quat_track *track, int idx, anm_time_t *tm, float *q)
+{
+	if(idx < 0 || idx >= track->count) {
+		return -1;
+	}
+	if(tm) *tm = track->times[idx];
+	if(q) memcpy(q, track->keys[idx].q, sizeof track->keys[idx].q);
+	return 0;
+}
+
+int anm_get_quat_key_interval(const struct anm_quat_track *track, anm_time_t tm)
+{
+	return times_interval(track->times, track->count, tm);
+}
+
+void anm_get_quat_value(const struct anm_quat_track *track, anm_time_t tm, float *qres)
+{
+	eval_quat_track(track, tm, qres, 0);
+}
+
+void anm_get_quat_value_cursor(const struct anm_quat_track *track, anm_time_t tm,
+		float *qres, struct anm_cursor *cur)
+{
+	eval_quat_track(track, tm, qres, cur);
+}
+
+static void eval_quat_track(const struct anm_quat_track *track, anm_time_t tm, float *qres,
+		struct anm_cursor *cur)
+{
+	int idx, last_idx;
+	anm_time_t tstart, tend;
+	float t, a, b;
+	const struct anm_quat_key *k0, *k1;
+
+	if(!track->count) {
+		memcpy(qres, track->def_val, sizeof track->def_val);
+		return;
+	}
+
+	last_idx = track->count - 1;
+
+	tstart = track->times[0];
+	tend = track->times[last_idx];
+
+	if(tstart == tend) {
+		memcpy(qres, track->keys[0].q, sizeof track->keys[0].q);
+		return;
+	}
+
+	tm = remap(track->extrap, tm, tstart, tend);
+
+	idx = cur ? times_interval_cursor(track->times, track->count, tm, cur) :
+		times_interval(track->times, track->count, tm);
+	assert(idx >= 0 && idx < track->count);
+
+	k0 = track->keys + idx;
+	if(idx == last_idx || track->interp == ANM_INTERP_STEP) {
+		memcpy(qres, k0->q, sizeof k0->q);
+		return;
+	}
+	k1 = k0 + 1;
+
+	t = (float)(tm - track->times[idx]) / (float)(track->times[idx + 1] - track->times[idx]);
+
+	if(k0->inv_sin == 0.0f) {
+		a = 1.0f - t;
+		b = t;
+	} else {
+		a = sinf((1.0f - t) * k0->angle) * k0->inv_sin;
+		b = sinf(t * k0->angle) * k0->inv_sin;
+	}
+	a *= k0->sign;
+
+	qres[0] = k0->q[0] * a + k1->q[0] * b;
+	qres[1] = k0->q[1] * a + k1->q[1] * b;
+	qres[2] = k0->q[2] * a + k1->q[2] * b;
+	qres[3] = k0->q[3] * a + k1->q[3] * b;
+}
+
+/* calculates the slerp constants of the segment from k0 to k1, like cgm_qslerp */
+static void calc_quat_seg(struct anm_quat_key *k0, const struct anm_quat_key *k1)
+{
+	float dot, sin_angle;
+
+	dot = k0->q[0] * k1->q[0] + k0->q[1] * k1->q[1] + k0->q[2] * k1->q[2] + k0->q[3] * k1->q[3];
+
+	/* interpolate across the shortest arc */
+	if(dot < 0.0f) {
+		k0->sign = -1.0f;
+		dot = -dot;
+	} else {
+		k0->sign = 1.0f;
+	}
+	if(dot > 1.0f) dot = 1.0f;
+
+	k0->angle = acos(dot);
+	sin_angle = sin(k0->angle);
+	k0->inv_sin = sin_angle == 0.0f ? 0.0f : 1.0f / sin_angle;
+}
+
+/* Same as anm_get_key_interval, for tracks with a plain array of key times */
+static int times_interval(const anm_time_t *times, int count, anm_time_t tm)
+{
+	int last = count - 1;
+
+	if(!count || tm < times[0]) {
+		return -1;
+	}
+	if(tm > times[last]) {
+		return last;
+	}
+	return find_prev_time(times, count, tm);
+}
+
+static int times_interval_cursor(const anm_time_t *times, int count, anm_time_t tm,
+		struct anm_cursor *cur)
+{
+	int idx = cur->idx, last = count - 1;
+
+	/* check the last interval found, and the next one, before searching */
+	if(idx >= 0 && idx < last && tm >= times[idx]) {
+		if(tm < times[idx + 1] || (idx + 1 == last && tm == times[last])) {
+			return idx;
+		}
+		idx++;
+		if(idx < last && (tm < times[idx + 1] || (idx + 1 == last && tm == times[last]))) {
+			cur->idx = idx;
+			return idx;
+		}
+	}
+
+	cur->idx = times_interval(times, count, tm);
+	return cur->idx;
+}
+
+/* Inserts a key of a track with a separate key times array, or replaces the
+ * one with the same time. keys is a dynamic array of keysz sized elements.
+ * If the times array is shared with other tracks, the track gets its own copy
+ * before a new key time is added.
+ * Returns the index of the key, or -1 on failure.
+ */
+static int insert_key(anm_time_t **times, int *shared, void **keys, size_t keysz, int count,
+		anm_time_t tm, const void *key)
+{
+	int idx, last;
+	void *tmp;
+	char *kptr;
+
+	idx = times_interval(*times, count, tm);
+	if(count && idx == count - 2 && (*times)[count - 1] == tm) {
+		/* exact hits on the last keyframe are reported as part of the last interval */
+		idx++;
+	}
+	if(idx >= 0 && (*times)[idx] == tm) {
+		memcpy((char*)*keys + idx * keysz, key, keysz);
+		return idx;
+	}
+
+	if(own_times(times, shared, count) == -1) {
+		return -1;
+	}
+
+	if(!(tmp = lazy_push(*times, &tm, sizeof tm))) {
+		return -1;
+	}
+	*times = tmp;
+	if(!(tmp = lazy_push(*keys, key, keysz))) {
+		*times = anm_dynarr_pop(*times);
+		return -1;
+	}
+	*keys = tmp;
+
+	idx++;
+	last = count;
+	kptr = (char*)*keys + idx * keysz;
+	memmove(*times + idx + 1, *times + idx, (last - idx) * sizeof **times);
+	memmove(kptr + keysz, kptr, (last - idx) * keysz);
+	(*times)[idx] = tm;
+	memcpy(kptr, key, keysz);
+	return idx;
+}
+
+/* replaces a shared key times array with a private copy */
+static int own_times(anm_time_t **times, int *shared, int count)
+{
+	anm_time_t *tmp;
+
+	if(!*shared) {
+		return 0;
+	}
+	if(!(tmp = anm_dynarr_alloc(count, sizeof *tmp))) {
+		return -1;
+	}
+	memcpy(tmp, *times, count * sizeof *tmp);
+	*times = tmp;
+	*shared = 0;
+	return 0;
+}
+
+
+/* ---- streaming tracks ---- */
+
+/* A streaming track is a single-producer/single-consumer ring buffer, guarded
+ * by a sequence counter instead of a lock. The producer makes the counter odd
+ * while it modifies the buffer, and even again when it's done. Readers copy
+ * what they need, and retry if the counter was odd or changed meanwhile. So
+ * appending never waits, and evaluation only repeats its keyframe search if
+ * it overlapped an append.
+ * Every access to shared data is atomic (see ATOMIC_LOAD), which orders the
+ * data accesses against the counter.
+ */
+
+/* keyframe i of a streaming track, counting from the oldest one at head */
+#define STREAM_KEY(trk, head, i)	((trk)->keys + (((head) + (i)) & ((trk)->cap - 1)))
+
+static void stream_write_begin(struct anm_stream_track *track);
+static void stream_write_end(struct anm_stream_track *track);
+static unsigned int stream_read_begin(const struct anm_stream_track *track);
+static int stream_read_end(const struct anm_stream_track *track, unsigned int seq);
+static int stream_lookup(const struct anm_stream_track *track, anm_time_t *tm,
+		anm_time_t *t0, anm_time_t *t1, float *v);
+
+int anm_init_stream_track(struct anm_stream_track *track, int capacity)
+{
+	int cap = 2;
+
+	while(cap < capacity) {
+		cap <<= 1;
+	}
+
+	memset(track, 0, sizeof *track);
+	if(!(track->keys = malloc(cap * sizeof *track->keys))) {
+		return -1;
+	}
+	track->cap = cap;
+	track->interp = ANM_INTERP_LINEAR;
+	track->extrap = ANM_EXTRAP_CLAMP;
+	return 0;
+}
+
+void anm_destroy_stream_track(struct anm_stream_track *track)
+{
+	free(track->keys);
+}
+
+void anm_set_stream_track_interpolator(struct anm_stream_track *track, enum anm_interpolator in)
+{
+	track->interp = in;
+}
+
+void anm_set_stream_track_extrapolator(struct anm_stream_track *track, enum anm_extrapolator ex)
+{
+	track->extrap = ex;
+}
+
+void anm_set_stream_track_default(struct anm_stream_track *track, float def)
+{
+	track->def_val = def;
+}
+
+int anm_append_stream_keyframe(struct anm_stream_track *track, anm_time_t tm, float val)
+{
+	/* only the producer modifies these, so it can read them directly */
+	int head = track->head, count = track->count;
+	struct anm_keyframe *key;
+
+	if(count) {
+		key = STREAM_KEY(track, head, count - 1);
+		if(tm < key->time) {
+			return -1;
+		}
+		if(tm == key->time) {
+			stream_write_begin(track);
+			ATOMIC_STORE(&key->val, &val);
+			stream_write_end(track);
+			return 0;
+		}
+	}
+
+	stream_write_begin(track);
+	if(count == track->cap) {
+		/* full, drop the oldest keyframe to make room */
+		head = (head + 1) & (track->cap - 1);
+		count--;
+		ATOMIC_STORE(&track->head, &head);
+	}
+	key = STREAM_KEY(track, head, count);
+	ATOMIC_STORE(&key->time, &tm);
+	ATOMIC_STORE(&key->val, &val);
+	count++;
+	ATOMIC_STORE(&track->count, &count);
+	stream_write_end(track);
+	return 0;
+}
+
+void anm_clear_stream_track(struct anm_stream_track *track)
+{
+	int zero = 0;
+
+	stream_write_begin(track);
+	ATOMIC_STORE(&track->head, &zero);
+	ATOMIC_STORE(&track->count, &zero);
+	stream_write_end(track);
+}
+
+int anm_get_stream_keyframe(const struct anm_stream_track *track, int idx, anm_time_t *tm, float *val)
+{
+	unsigned int seq;
+	int head, count;
+	anm_time_t t = 0;
+	float v = 0.0f;
+	const struct anm_keyframe *key;
+
+	do {
+		seq = stream_read_begin(track);
+		ATOMIC_LOAD(&track->head, &head);
+		ATOMIC_LOAD(&track->count, &count);
+		if(idx >= 0 && idx < count) {
+			key = STREAM_KEY(track, head, idx);
+			ATOMIC_LOAD(&key->time, &t);
+			ATOMIC_LOAD(&key->val, &v);
+		}
+	} while(!stream_read_end(track, seq));
+
+	if(idx < 0 || idx >= count) {
+		return -1;
+	}
+	if(tm) *tm = t;
+	if(val) *val = v;
+	return 0;
+}
+
+float anm_get_stream_value(const struct anm_stream_track *track, anm_time_t tm)
+{
+	unsigned int seq;
+	int res;
+	anm_time_t t, t0, t1;
+	float v[4];
+
+	/* the lookup works on a copy of tm, which it remaps */
+	do {
+		seq = stream_read_begin(track);
+		t = tm;
+		res = stream_lookup(track, &t, &t0, &t1, v);
+	} while(!stream_read_end(track, seq));
+
+	switch(res) {
+	case 0:
+		return track->def_val;
+	case 1:
+		return v[1];
+	default:
+		break;
+	}
+	return interpolate(track->interp, v[0], v[1], v[2], v[3], (float)(t - t0) / (float)(t1 - t0));
+}
+
+static void stream_write_begin(struct anm_stream_track *track)
+{
+	unsigned int seq = track->seq + 1;
+
+	ATOMIC_STORE(&track->seq, &seq);
+}
+
+static void stream_write_end(struct anm_stream_track *track)
+{
+	unsigned int seq = track->seq + 1;
+
+	ATOMIC_STORE(&track->seq, &seq);
+}
+
+static unsigned int stream_read_begin(const struct anm_stream_track *track)
+{
+	unsigned int seq;
+
+	do {
+		ATOMIC_LOAD(&track->seq, &seq);
+	} while(seq & 1);
+	return seq;
+}
+
+/* returns 0 if the data read since stream_read_begin might be inconsistent */
+static int stream_read_end(const struct anm_stream_track *track, unsigned int seq)
+{
+	unsigned int cur;
+
+	ATOMIC_LOAD(&track->seq, &cur);
+	return cur == seq;
+}
+
+#define STREAM_SCAN_MAX	16
+
+/* Finds the keyframes around tm, and copies the four values an interpolation
+ * needs to v, and the times of the interval to t0 and t1, after remapping tm.
+ * Returns 0 if the track is empty, 1 if it's constant (the value is in v[1]),
+ * or 2 otherwise.
+ * The buffer may change while this runs. The results are only used if
+ * stream_read_end succeeds, but in the meantime all indices are kept in range,
+ * and every loop is bounded.
+ */
+static int stream_lookup(const struct anm_stream_track *track, anm_time_t *tm,
+		anm_time_t *t0, anm_time_t *t1, float *v)
+{
+	int i, idx, last, lo, hi, head, count;
+	anm_time_t t, kt;
+
+	ATOMIC_LOAD(&track->head, &head);
+	ATOMIC_LOAD(&track->count, &count);
+	if(count <= 0 || count > track->cap) {
+		return 0;
+	}
+
+	last = count - 1;
+	ATOMIC_LOAD(&STREAM_KEY(track, head, 0)->time, t0);
+	ATOMIC_LOAD(&STREAM_KEY(track, head, last)->time, t1);
+
+	if(*t0 >= *t1) {
+		ATOMIC_LOAD(&STREAM_KEY(track, head, 0)->val, v + 1);
+		return 1;
+	}
+
+	t = *tm = remap(track->extrap, *tm, *t0, *t1);
+
+	/* live input is mostly sampled a little behind the newest keyframe, so
+	 * step back a few intervals from the last one before searching. Exact
+	 * hits on the last keyframe end up in the last interval.
+	 */
+	idx = last - 1;
+	for(i=0; i<STREAM_SCAN_MAX && idx > 0; i++) {
+		ATOMIC_LOAD(&STREAM_KEY(track, head, idx)->time, &kt);
+		if(t >= kt) break;
+		idx--;
+	}
+	ATOMIC_LOAD(&STREAM_KEY(track, head, idx)->time, &kt);
+	if(t < kt) {
+		lo = 0;
+		hi = idx;
+		while(hi - lo > 1) {
+			idx = (lo + hi) / 2;
+			ATOMIC_LOAD(&STREAM_KEY(track, head, idx)->time, &kt);
+			if(kt <= t) {
+				lo = idx;
+			} else {
+				hi = idx;
+			}
+		}
+		idx = lo;
+	}
+
+	ATOMIC_LOAD(&STREAM_KEY(track, head, idx)->time, t0);
+	ATOMIC_LOAD(&STREAM_KEY(track, head, idx + 1)->time, t1);
+	ATOMIC_LOAD(&STREAM_KEY(track, head, idx)->val, v + 1);
+	ATOMIC_LOAD(&STREAM_KEY(track, head, idx + 1)->val, v + 2);
+	if(idx > 0) {
+		ATOMIC_LOAD(&STREAM_KEY(track, head, idx - 1)->val, v);
+	} else {
+		v[0] = v[1];
+	}
+	if(idx + 1 < last) {
+		ATOMIC_LOAD(&STREAM_KEY(track, head, idx + 2)->val, v + 3);
+	} else {
+		v[3] = v[2];
+	}
+
+	/* a torn read can make the interval empty, avoid dividing by zero */
+	if(*t1 <= *t0) {
+		*t1 = *t0 + 1;
+	}
+	return 2;
+}
+
+
+/* ---- event tracks ---- */
+
+/* range of a query, and of the events which can occur in it */
+struct event_query {
+	anm_time_t start, end, period;
+	int repeat;		/* REPEAT or PINGPONG with a non-empty range */
+	int lo, hi;		/* events in the range */
+	int blo, bhi;	/* events strictly inside the range, repeated backwards by PINGPONG */
+};
+
+int anm_init_event_track(struct anm_event_track *track)
+{
+	/* events are allocated when the first one is added */
+	memset(track, 0, sizeof *track);
+	track->extrap = ANM_EXTRAP_CLAMP;
+	return 0;
+}
+
+void anm_destroy_event_track(struct anm_event_track *track)
+{
+	anm_dynarr_free(track->events);
+}
+
+void anm_set_event_track_extrapolator(struct anm_event_track *track, enum anm_extrapolator ex)
+{
+	track->extrap = ex;
+}
+
+void anm_set_event_track_range(struct anm_event_track *track, anm_time_t start, anm_time_t end)
+{
+	track->start = start;
+	track->end = end;
+	track->range_set = 1;
+}
+
+int anm_add_event(struct anm_event_track *track, anm_time_t tm, int id)
+{
+	int idx;
+	struct anm_event ev, *tmp;
+
+	ev.time = tm;
+	ev.id = id;
+
+	/* after any events at the same time */
+	idx = event_bound(track->events, track->count, tm, 0);
+
+	if(!(tmp = lazy_push(track->events, &ev, sizeof ev))) {
+		return -1;
+	}
+	track->events = tmp;
+
+	if(idx < track->count) {
+		memmove(tmp + idx + 1, tmp + idx, (track->count - idx) * sizeof *tmp);
+		tmp[idx] = ev;
+	}
+	track->count++;
+	return 0;
+}
+
+int anm_remove_event(struct anm_event_track *track, int idx)
+{
+	if(idx < 0 || idx >= track->count) {
+		return -1;
+	}
+	memmove(track->events + idx, track->events + idx + 1,
+			(track->count - idx - 1) * sizeof *track->events);
+	track->events = anm_dynarr_pop(track->events);
+	track->count--;
+	return 0;
+}
+
+void anm_clear_event_track(struct anm_event_track *track)
+{
+	anm_dynarr_free(track->events);
+	track->events = 0;
+	track->count = 0;
+}
+
+const struct anm_event *anm_get_event(const struct anm_event_track *track, int idx)
+{
+	if(idx < 0 || idx >= track->count) {
+		return 0;
+	}
+	return track->events + idx;
+}
+
+int anm_get_events(const struct anm_event_track *track, anm_time_t t0, anm_time_t t1,
+		struct anm_event *res, int max)
+{
+	struct event_query q;
+
+	if(!track->count || t1 <= t0 || max <= 0) {
+		return 0;
+	}
+	event_range(track, &q);
+	return find_events(track, &q, t0, t1, res, max);
+}
+
+int anm_get_events_batch(const struct anm_event_track *track, const anm_time_t *t0,
+		const anm_time_t *t1, int n, struct anm_event *res, int max, int *first)
+{
+	int i, count = 0;
+	struct event_query q;
+
+	if(track->count) {
+		event_range(track, &q);
+	}
+
+	for(i=0; i<n; i++) {
+		first[i] = count;
+		if(track->count && t1[i] > t0[i] && count < max) {
+			count += find_events(track, &q, t0[i], t1[i], res + count, max - count);
+		}
+	}
+	first[n] = count;
+	return count;
+}
+
+static void event_range(const struct anm_event_track *track, struct event_query *q)
+{
+	if(track->range_set) {
+		q->start = track->start;
+		q->end = track->end;
+	} else {
+		q->start = track->events[0].time;
+		q->end = track->events[track->count - 1].time;
+	}
+	q->period = q->end - q->start;
+	q->repeat = q->period > 0 && (track->extrap == ANM_EXTRAP_REPEAT ||
+			track->extrap == ANM_EXTRAP_PINGPONG);
+
+	q->lo = event_bound(track->events, track->count, q->start, 1);
+	q->hi = event_bound(track->events, track->count, q->end, 0);
+	q->blo = event_bound(track->events, track->count, q->start, 0);
+	q->bhi = event_bound(track->events, track->count, q->end, 1);
+}
+
+/* The timeline of a repeated track is divided in spans of one period, the
+ * first of which starts at the start of the range. With ANM_EXTRAP_REPEAT
+ * every span holds all events of the range, so an event at the end of the
+ * range occurs together with an event at the start of the next span. With
+ * ANM_EXTRAP_PINGPONG, the odd spans hold the events in reverse, mirrored
+ * around the end of the preceding span. Events at the ends of the range
+ * only occur in the even spans, so that they don't occur twice at the
+ * turning points.
+ * Only the spans overlapping the interval are visited, and each of them
+ * holds at least one event, unless the range is empty.
+ */
+static int find_events(const struct anm_event_track *track, const struct event_query *q,
+		anm_time_t t0, anm_time_t t1, struct anm_event *res, int max)
+{
+	int n = 0;
+	anm_time_t span, last_span;
+
+	if(!q->repeat) {
+		return events_fwd(track->events, 0, track->count, 0, t0, t1, res, 0, max);
+	}
+	if(q->lo >= q->hi) {
+		return 0;
+	}
+
+	last_span = floor_div(t1 - q->start, q->period);
+
+	if(track->extrap == ANM_EXTRAP_REPEAT) {
+		/* the first span with an occurrence of the last event after t0 */
+		span = floor_div(t0 - q->end, q->period) + 1;
+		for(; span <= last_span && n < max; span++) {
+			n = events_fwd(track->events, q->lo, q->hi, span * q->period, t0, t1, res, n, max);
+		}
+	} else {
+		span = floor_div(t0 - q->start, q->period);
+		for(; span <= last_span && n < max; span++) {
+			if(span % 2) {
+				n = events_back(track->events, q->blo, q->bhi,
+						q->start + (span + 1) * q->period + q->start, t0, t1, res, n, max);
+			} else {
+				n = events_fwd(track->events, q->lo, q->hi, span * q->period, t0, t1, res, n, max);
+			}
+		}
+	}
+	return n;
+}
+
+/* appends the events in [lo, hi), occurring at their time + offs, which
+ * fall in (t0, t1]
+ */
+static int events_fwd(const struct anm_event *ev, int lo, int hi, anm_time_t offs,
+		anm_time_t t0, anm_time_t t1, struct anm_event *res, int n, int max)
+{
+	int i;
+
+	i = lo + event_bound(ev + lo, hi - lo, t0 - offs, 0);
+	t1 -= offs;
+
+	while(i < hi && ev[i].time <= t1 && n < max) {
+		res[n].time = ev[i].time + offs;
+		res[n++].id = ev[i++].id;
+	}
+	return n;
+}
+
+/* appends the events in [lo, hi), occurring at mirror - their time, which
+ * fall in (t0, t1], starting from the last one
+ */
+static int events_back(const struct anm_event *ev, int lo, int hi, anm_time_t mirror,
+		anm_time_t t0, anm_time_t t1, struct anm_event *res, int n, int max)
+{
+	int i;
+
+	if(lo >= hi) {
+		return n;
+	}
+
+	i = lo + event_bound(ev + lo, hi - lo, mirror - t0, 1) - 1;
+	t1 = mirror - t1;
+
+	while(i >= lo && ev[i].time >= t1 && n < max) {
+		res[n].time = mirror - ev[i].time;
+		res[n++].id = ev[i--].id;
+	}
+	return n;
+}
+
+/* index of the first event after tm, or at tm or after it if incl is true */
+static int event_bound(const struct anm_event *ev, int count, anm_time_t tm, int incl)
+{
+	int lo = 0, hi = count, mid;
+
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		if(ev[mid].time < tm || (!incl && ev[mid].time == tm)) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/* division rounding towards negative infinity, for b > 0 */
+static anm_time_t floor_div(anm_time_t a, anm_time_t b)
+{
+	anm_time_t q = a / b;
+	return a % b < 0 ? q - 1 : q;
+}
+
+
+/* ---- keyframe reduction ---- */
+
+#define SIMPLIFY_MAX_TRACKS	4
+
+struct simplify {
+	int ntrk, count, quat;
+	enum anm_interpolator interp;
+	float max_err;
+
+	anm_time_t *times;
+	float *vals;	/* original keyframe values, ntrk per key */
+	float *ref;		/* original values half-way between keys, ntrk per segment */
+	int *prev, *next;	/* doubly linked list of the keys still in use */
+};
+
+int anm_simplify_track(struct anm_track *track, float max_err)
+{
+	return simplify(&track, 1, max_err, 0);
+}
+
+int anm_simplify_tracks(struct anm_track **tracks, int count, float max_err)
+{
+	int i, res, nrem = 0;
+
+	if(count <= 0 || count > SIMPLIFY_MAX_TRACKS) {
+		return -1;
+	}
+	if(same_key_times(tracks, count)) {
+		return simplify(tracks, count, max_err, 0);
+	}
+
+	/* no shared keyframes to remove, fall back to simplifying each track
+	 * separately, with a tolerance which still bounds the vector error.
+	 */
+	max_err /= sqrt(count);
+	for(i=0; i<count; i++) {
+		if((res = simplify(tracks + i, 1, max_err, 0)) == -1) {
+			return -1;
+		}
+		nrem += res;
+	}
+	return nrem;
+}
+
+int anm_simplify_quat(struct anm_track *xtrk, struct anm_track *ytrk,
+		struct anm_track *ztrk, struct anm_track *wtrk, float max_angle)
+{
+	struct anm_track *trk[4];
+
+	trk[0] = xtrk;
+	trk[1] = ytrk;
+	trk[2] = ztrk;
+	trk[3] = wtrk;
+
+	if(!same_key_times(trk, 4)) {
+		return -1;
+	}
+	return simplify(trk, 4, max_angle, 1);
+}
+
+static int simplify(struct anm_track **trk, int ntrk, float max_err, int quat)
+{
+	int i, j, k, nrem, count;
+	struct simplify s;
+	float *val;
+
+	for(i=0; i<ntrk; i++) {
+		UPDATE_TRACK(trk[i]);
+	}
+	if((count = trk[0]->count) < 3) {
+		return 0;
+	}
+
+	/* anm_get_quat always uses slerp, regardless of the interpolator */
+	if(init_simplify(&s, count, ntrk, quat ? ANM_INTERP_LINEAR : trk[0]->interp,
+				max_err, quat) == -1) {
+		return -1;
+	}
+
+	val = s.vals;
+	for(i=0; i<count; i++) {
+		s.times[i] = KEY_TIME(trk[0], i);
+		for(j=0; j<ntrk; j++) {
+			*val++ = KEY_VAL(trk[j], i);
+		}
+	}
+
+	if((nrem = simplify_keys(&s)) > 0) {
+		for(j=0; j<ntrk; j++) {
+			if(PACKED_LAYOUT(trk[j]) && anm_set_track_layout(trk[j], ANM_KEYS_SOA) == -1) {
+				nrem = -1;
+				goto end;
+			}
+			k = 0;
+			for(i=0; i>=0; i=s.next[i]) {
+				SET_KEY(trk[j], k, s.times[i], s.vals[i * ntrk + j]);
+				k++;
+			}
+			resize_keys(trk[j], k);
+			trk[j]->count = trk[j]->nsorted = k;
+			KEYS_CHANGED(trk[j]);
+		}
+		nrem *= ntrk;
+	}
+
+end:
+	destroy_simplify(&s);
+	return nrem;
+}
+
+int anm_simplify_vec3_track(struct anm_vec3_track *track, float max_err)
+{
+	int i, k, nrem;
+	struct simplify s;
+	void *tmp;
+
+	if(track->count < 3) {
+		return 0;
+	}
+	if(init_simplify(&s, track->count, 3, track->interp, max_err, 0) == -1) {
+		return -1;
+	}
+	memcpy(s.times, track->times, track->count * sizeof *s.times);
+	for(i=0; i<track->count; i++) {
+		memcpy(s.vals + i * 3, track->keys[i].v, 3 * sizeof *s.vals);
+	}
+
+	if((nrem = simplify_keys(&s)) > 0) {
+		if(own_times(&track->times, &track->times_shared, track->count) == -1) {
+			nrem = -1;
+			goto end;
+		}
+		k = 0;
+		for(i=0; i>=0; i=s.next[i]) {
+			track->times[k] = track->times[i];
+			track->keys[k++] = track->keys[i];
+		}
+		if((tmp = anm_dynarr_resize(track->times, k))) {
+			track->times = tmp;
+		}
+		if((tmp = anm_dynarr_resize(track->keys, k))) {
+			track->keys = tmp;
+		}
+		track->count = k;
+	}
+
+end:
+	destroy_simplify(&s);
+	return nrem;
+}
+
+int anm_simplify_quat_track(struct anm_quat_track *track, float max_angle)
+{
+	int i, k, nrem;
+	struct simplify s;
+	void *tmp;
+
+	if(track->count < 3) {
+		return 0;
+	}
+	if(init_simplify(&s, track->count, 4, track->interp == ANM_INTERP_STEP ?
+				ANM_INTERP_STEP : ANM_INTERP_LINEAR, max_angle, 1) == -1) {
+		return -1;
+	}
+	memcpy(s.times, track->times, track->count * sizeof *s.times);
+	for(i=0; i<track->count; i++) {
+		memcpy(s.vals + i * 4, track->keys[i].q, sizeof track->keys[i].q);
+	}
+
+	if((nrem = simplify_keys(&s)) > 0) {
+		if(own_times(&track->times, &track->times_shared, track->count) == -1) {
+			nrem = -1;
+			goto end;
+		}
+		k = 0;
+		for(i=0; i>=0; i=s.next[i]) {
+			track->times[k] = track->times[i];
+			track->keys[k] = track->keys[i];
+			if(k > 0) {
+				calc_quat_seg(track->keys + k - 1, track->keys + k);
+			}
+			k++;
+		}
+		if((tmp = anm_dynarr_resize(track->times, k))) {
+			track->times = tmp;
+		}
+		if((tmp = anm_dynarr_resize(track->keys, k))) {
+			track->keys = tmp;
+		}
+		track->count = k;
+	}
+
+end:
+	destroy_simplify(&s);
+	return nrem;
+}
+
+static int init_simplify(struct simplify *s, int count, int ntrk, enum anm_interpolator interp,
+		float max_err, int quat)
+{
+	s->ntrk = ntrk;
+	s->count = count;
+	s->quat = quat;
+	s->interp = interp;
+	s->max_err = max_err;
+
+	s->times = malloc(count * sizeof *s->times);
+	s->vals = malloc(count * ntrk * sizeof *s->vals);
+	s->ref = malloc((count - 1) * ntrk * sizeof *s->ref);
+	s->prev = malloc(count * sizeof *s->prev);
+	s->next = malloc(count * sizeof *s->next);
+	if(!s->times || !s->vals || !s->ref || !s->prev || !s->next) {
+		destroy_simplify(s);
+		return -1;
+	}
+	return 0;
+}
+
+static void destroy_simplify(struct simplify *s)
+{
+	free(s->times);
+	free(s->vals);
+	free(s->ref);
+	free(s->prev);
+	free(s->next);
+}
+
+/* Greedy keyframe removal. Each key is tentatively unlinked from the list of
+ * keys in use, and the segments affected by its removal are checked against
+ * the original values at every original key time, and half-way between them.
+ * Since every removal re-checks all the segments it changes, the final set of
+ * keys never deviates from the original by more than max_err at these points.
+ * Returns the number of keys removed, the rest are left linked in prev/next.
+ */
+static int simplify_keys(struct simplify *s)
+{
+	int i, p, n, first, last, nrem = 0;
+
+	for(i=0; i<s->count; i++) {
+		s->prev[i] = i - 1;
+		s->next[i] = i + 1;
+	}
+	s->next[s->count - 1] = -1;
+
+	for(i=0; i<s->count - 1; i++) {
+		simplify_eval(s, i, s->times[i] + (s->times[i + 1] - s->times[i]) / 2,
+				s->ref + i * s->ntrk);
+	}
+
+	/* the first and last keys are always kept, to preserve the time range */
+	for(i=1; i<s->count - 1; i++) {
+		p = s->prev[i];
+		n = s->next[i];
+		s->next[p] = n;
+		s->prev[n] = p;
+
+		first = p;
+		last = n;
+		if(s->interp == ANM_INTERP_CUBIC && !s->quat) {
+			/* the neighbouring segments use the removed key as a control point */
+			if(s->prev[p] >= 0) first = s->prev[p];
+			if(s->next[n] >= 0) last = s->next[n];
+		}
+
+		if(simplify_check(s, first, last)) {
+			nrem++;
+		} else {
+			s->next[p] = i;
+			s->prev[n] = i;
+		}
+	}
+	return nrem;
+}
+
+/* checks the segments starting at keys first up to (but not including) last */
+static int simplify_check(const struct simplify *s, int first, int last)
+{
+	int a, b, i, ntrk = s->ntrk;
+	float res[SIMPLIFY_MAX_TRACKS];
+
+	for(a=first; a!=last; a=b) {
+		b = s->next[a];
+
+		for(i=a; i<b; i++) {
+			if(i > a) {
+				simplify_eval(s, a, s->times[i], res);
+				if(simplify_error(s, res, s->vals + i * ntrk) > s->max_err) {
+					return 0;
+				}
+			}
+			simplify_eval(s, a, s->times[i] + (s->times[i + 1] - s->times[i]) / 2, res);
+			if(simplify_error(s, res, s->ref + i * ntrk) > s->max_err) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+/* evaluates the segment starting at key a, the same way as anm_get_value or
+ * anm_get_quat would, if the unlinked keys were removed from the tracks.
+ */
+static void simplify_eval(const struct simplify *s, int a, anm_time_t tm, float *res)
+{
+	int i, b, ntrk = s->ntrk;
+	const float *v0, *v1, *v2, *v3;
+	float t;
+
+	b = s->next[a];
+	t = (float)(tm - s->times[a]) / (float)(s->times[b] - s->times[a]);
+
+	v1 = s->vals + a * ntrk;
+	v2 = s->vals + b * ntrk;
+
+	if(s->quat && s->interp != ANM_INTERP_STEP) {
+		cgm_qslerp((cgm_quat*)res, (const cgm_quat*)v1, (const cgm_quat*)v2, t);
+		return;
+	}
+
+	v0 = s->prev[a] >= 0 ? s->vals + s->prev[a] * ntrk : v1;
+	v3 = s->next[b] >= 0 ? s->vals + s->next[b] * ntrk : v2;
+
+	for(i=0; i<ntrk; i++) {
+		res[i] = interpolate(s->interp, v0[i], v1[i], v2[i], v3[i], t);
+	}
+}
+
+static float simplify_error(const struct simplify *s, const float *v1, const float *v2)
+{
+	int i;
+	float d, err = 0.0f;
+	double dot, len1, len2;
+
+	if(s->quat) {
+		/* angle of the rotation between the two orientations. This is done in
+		 * double precision, because acos is very ill-conditioned close to 1,
+		 * which is exactly where the small tolerances of interest end up.
+		 */
+		dot = (double)v1[0] * v2[0] + (double)v1[1] * v2[1] + (double)v1[2] * v2[2] +
+			(double)v1[3] * v2[3];
+		len1 = (double)v1[0] * v1[0] + (double)v1[1] * v1[1] + (double)v1[2] * v1[2] +
+			(double)v1[3] * v1[3];
+		len2 = (double)v2[0] * v2[0] + (double)v2[1] * v2[1] + (double)v2[2] * v2[2] +
+			(double)v2[3] * v2[3];
+		if(len1 == 0.0 || len2 == 0.0) {
+			return len1 == len2 ? 0.0f : 2.0f * acos(0.0);
+		}
+		dot = fabs(dot) / sqrt(len1 * len2);
+		return dot >= 1.0 ? 0.0f : 2.0 * acos(dot);
+	}
+
+	for(i=0; i<s->ntrk; i++) {
+		d = v1[i] - v2[i];
+		err += d * d;
+	}
+	return sqrt(err);
+}
+
+static int same_key_times(struct anm_track **trk, int ntrk)
+{
+	int i, j;
+
+	for(i=0; i<ntrk; i++) {
+		UPDATE_TRACK(trk[i]);
+	}
+	for(i=1; i<ntrk; i++) {
+		if(trk[i]->count != trk[0]->count) {
+			return 0;
+		}
+		for(j=0; j<trk[0]->count; j++) {
+			if(KEY_TIME(trk[i], j) != KEY_TIME(trk[0], j)) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+
+static FORCE_INLINE float interpolate(enum anm_interpolator in, float v0, float v1,
+		float v2, float v3, float t)
+{
+	switch(in) {
+	case ANM_INTERP_STEP:
+		return v1;
+	case ANM_INTERP_LINEAR:
+		return v1 + (v2 - v1) * t;
+	default:
+		break;
+	}
+	return interp_cubic(v0, v1, v2, v3, t);
+}
+
+static float interp_cubic(float a, float b, float c, float d, float t)
+{
+	float x, y, z, w;
+	float tsq = t * t;
+
+	x = -a + 3.0f * b - 3.0f * c + d;
+	y = 2.0f * a - 5.0f * b + 4.0f * c - d;
+	z = c - a;
+	w = 2.0f * b;
+
+	return 0.5f * (x * tsq * t + y * tsq + z * t + w);
+}
+
+static FORCE_INLINE anm_time_t remap(enum anm_extrapolator ex, anm_time_t tm,
+		anm_time_t start, anm_time_t end)
+{
+	switch(ex) {
+	case ANM_EXTRAP_EXTEND:
+		return remap_extend(tm, start, end);
+	case ANM_EXTRAP_REPEAT:
+		return remap_repeat(tm, start, end);
+	case ANM_EXTRAP_PINGPONG:
+		return remap_pingpong(tm, start, end);
+	default:
+		break;
+	}
+	return remap_clamp(tm, start, end);
 }
 
 static anm_time_t remap_extend(anm_time_t tm, anm_time_t start, anm_time_t end)
@@ -392,5 +3353,5 @@ static anm_time_t remap_pingpong(anm_time_t tm, anm_time_t start, anm_time_t end
 	anm_time_t interv = end - start;
 	anm_time_t x = remap_repeat(tm, start, end + interv);
 
-	return x > end ? end + interv - x : x;
+	return x > end ? end + end - x : x;
 }
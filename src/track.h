@@ -25,6 +25,10 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <limits.h>
 #include "config.h"
 
+#ifdef ANIM_THREAD_SAFE
+#include <pthread.h>
+#endif
+
 enum anm_interpolator {
 	ANM_INTERP_STEP,
 	ANM_INTERP_LINEAR,
@@ -48,6 +52,24 @@ typedef long anm_time_t;
 #define ANM_TM2SEC(x)	((x) / 1000.0)
 #define ANM_TM2MSEC(x)	(x)
 
+enum anm_key_layout {
+	ANM_KEYS_AOS,	/* array of anm_keyframe structures (default) */
+	ANM_KEYS_SOA,	/* separate contiguous arrays of key times and values */
+	ANM_KEYS_SAMPLED,	/* uniformly spaced keyframes, only values are stored */
+	ANM_KEYS_QUANTIZED	/* compressed keyframes, see anm_quantize_track */
+};
+
+/* track options, see anm_set_track_option */
+enum anm_track_option {
+	ANM_TRACK_LAZY_SORT,	/* defer sorting new keyframes until the next evaluation */
+	ANM_TRACK_CUBIC_CACHE,	/* precalculate the cubic polynomial of each segment */
+	ANM_TRACK_SLERP_CACHE	/* precalculate slerp angles, see anm_get_quat */
+};
+
+struct anm_slerp_cache;
+struct anm_search_index;
+struct anm_quant_keys;
+
 struct anm_keyframe {
 	anm_time_t time;
 	float val;
@@ -56,7 +78,104 @@ struct anm_keyframe {
 struct anm_track {
 	char *name;
 	int count;
+	struct anm_keyframe *keys;	/* ANM_KEYS_AOS */
+	anm_time_t *times;			/* ANM_KEYS_SOA */
+	float *vals;				/* ANM_KEYS_SOA and ANM_KEYS_SAMPLED */
+	anm_time_t tstart, period;	/* ANM_KEYS_SAMPLED: key i is at tstart + i * period */
+	struct anm_quant_keys *quant;	/* ANM_KEYS_QUANTIZED */
+
+	float def_val;
+
+	enum anm_interpolator interp;
+	enum anm_extrapolator extrap;
+	enum anm_key_layout layout;
+
+	unsigned int opt;	/* enabled options, one bit per anm_track_option */
+	int nsorted;		/* number of keyframes in sorted order (pending lazy sort) */
+	int dirty;			/* lazy updates pending (bitmask), see anm_update_track */
+
+	unsigned int rev;	/* incremented whenever the keyframes change */
+
+	float *coef;		/* per-segment cubic coefficients (ANM_TRACK_CUBIC_CACHE) */
+	struct anm_slerp_cache *slerp;	/* ANM_TRACK_SLERP_CACHE */
+	struct anm_search_index *index;	/* built automatically for long tracks */
+
+	struct anm_keyframe tmpkey;	/* returned by anm_get_keyframe for non-AOS layouts */
+};
+
+/* Lookup cursor, owned by the caller. It remembers the last keyframe interval
+ * found in a track, so that subsequent lookups close to the previous one (for
+ * instance during playback, where time advances monotonically by small steps)
+ * can be resolved by checking the neighbouring intervals, instead of
+ * searching the whole track.
+ * A cursor can be used with any track, but it's most effective when it's
+ * dedicated to a single track.
+ */
+struct anm_cursor {
+	int idx;
+};
+
+/* keyframe of an anm_vec3_track, padded to 4 floats for SIMD */
+struct anm_vec3_key {
+	float v[4];		/* x, y, z, unused */
+};
+
+/* A 3D vector track, for position and scaling keyframes, with a single array
+ * of key times and the three components of each key stored together. It
+ * replaces three scalar tracks with identical key times, and is evaluated
+ * with a single search, and one interpolation of all three components.
+ */
+struct anm_vec3_track {
+	int count;
+	anm_time_t *times;
+	int times_shared;	/* times is owned elsewhere, and copied before it's modified */
+	struct anm_vec3_key *keys;
+
+	float def_val[3];
+
+	enum anm_interpolator interp;
+	enum anm_extrapolator extrap;
+};
+
+/* rotation keyframe of an anm_quat_track */
+struct anm_quat_key {
+	float q[4];		/* x, y, z, w */
+	/* slerp constants of the segment starting at this key */
+	float angle, inv_sin, sign;
+	float pad;
+};
+
+/* A rotation track holds quaternion keyframes, with a single array of key
+ * times, and the four quaternion components of each key stored together,
+ * along with the precalculated slerp constants of the segment which starts
+ * there. This replaces four scalar tracks with identical key times, and lets
+ * a slerp between two keyframes read a single cache line.
+ */
+struct anm_quat_track {
+	int count;
+	anm_time_t *times;
+	int times_shared;	/* times is owned elsewhere, and copied before it's modified */
+	struct anm_quat_key *keys;
+
+	float def_val[4];
+
+	enum anm_interpolator interp;	/* ANM_INTERP_STEP or slerp for anything else */
+	enum anm_extrapolator extrap;
+};
+
+/* A streaming track keeps the most recent keyframes of a live input in a
+ * fixed-capacity circular buffer. Keyframes are appended in increasing time
+ * order, and once the buffer is full, each new keyframe replaces the oldest
+ * one. One thread can append keyframes while another evaluates the track,
+ * without locking, in any build. Appending from multiple threads at once is
+ * not supported.
+ */
+struct anm_stream_track {
+	int cap;		/* capacity, a power of two */
+	int head;		/* buffer index of the oldest keyframe */
+	int count;
 	struct anm_keyframe *keys;
+	unsigned int seq;	/* odd while the buffer is being modified */
 
 	float def_val;
 
@@ -64,6 +183,29 @@ struct anm_track {
 	enum anm_extrapolator extrap;
 };
 
+/* an event, identified by an arbitrary user-defined id, at a point in time */
+struct anm_event {
+	anm_time_t time;
+	int id;
+};
+
+/* An event track holds events (footsteps, sound cues, etc) at specific times,
+ * and finds the events which occur during a time interval, typically the
+ * time between the previous and the current frame.
+ * With ANM_EXTRAP_REPEAT or ANM_EXTRAP_PINGPONG, the events in the range of
+ * the track (see anm_set_event_track_range) occur once in every repetition.
+ * Otherwise every event only occurs once, at its time.
+ */
+struct anm_event_track {
+	int count;
+	struct anm_event *events;	/* sorted by time */
+
+	anm_time_t start, end;	/* repeated range, if set with anm_set_event_track_range */
+	int range_set;
+
+	enum anm_extrapolator extrap;
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -92,15 +234,93 @@ anm_time_t anm_remap_time(const struct anm_track *track, anm_time_t tm,
 
 void anm_set_track_default(struct anm_track *track, float def);
 
+/* Changes the keyframe storage layout of the track, converting any existing
+ * keyframes. ANM_KEYS_SOA keeps key times in a separate contiguous array, which
+ * halves the memory traffic of key searches and avoids the padding of the
+ * anm_keyframe structure. ANM_KEYS_SAMPLED is only possible if the keyframes
+ * are uniformly spaced in time; it stores just the values, and finds the
+ * keyframe interval of any time with a single division.
+ * Returns -1 on failure, leaving the track unchanged.
+ *
+ * Setting a keyframe which doesn't fall on the sample grid of an
+ * ANM_KEYS_SAMPLED track (or after the sample following the last one),
+ * switches it to ANM_KEYS_SOA.
+ */
+int anm_set_track_layout(struct anm_track *track, enum anm_key_layout layout);
+enum anm_key_layout anm_get_track_layout(const struct anm_track *track);
+
+/* Replaces all keyframes of the track with count values sampled every period
+ * time units, starting at start, and switches it to ANM_KEYS_SAMPLED.
+ */
+int anm_set_track_samples(struct anm_track *track, anm_time_t start, anm_time_t period,
+		const float *vals, int count);
+
+/* Compresses the keyframes of the track, and switches it to ANM_KEYS_QUANTIZED.
+ * Values are normalized to the range of the track and stored with val_bits
+ * precision, which can be 8 or 16 (the default when switching layouts with
+ * anm_set_track_layout). Key times are stored as 16bit offsets, or 32bit if
+ * any two keys are too far apart, from the first key of every block of 32.
+ * This brings memory use down to about 4.25 bytes per keyframe.
+ * Quantized tracks are decoded on the fly during evaluation; setting any
+ * keyframe switches them back to ANM_KEYS_SOA.
+ * Returns -1 on failure, leaving the track unchanged.
+ */
+int anm_quantize_track(struct anm_track *track, int val_bits);
+
+void anm_set_track_option(struct anm_track *track, enum anm_track_option opt, int val);
+int anm_get_track_option(const struct anm_track *track, enum anm_track_option opt);
+
+/* Performs any work deferred by track options, such as sorting keyframes added
+ * with ANM_TRACK_LAZY_SORT, or recalculating the ANM_TRACK_CUBIC_CACHE
+ * coefficients after keyframes change. This is done automatically on the next access, but
+ * tracks with pending work should be updated before they are evaluated from
+ * multiple threads concurrently, unless libanim was built with thread safety.
+ */
+void anm_update_track(struct anm_track *track);
+
 /* set or update a keyframe */
 int anm_set_keyframe(struct anm_track *track, struct anm_keyframe *key);
+/* set or update multiple keyframes, given in any order. If the same time
+ * appears more than once, the last one wins. The keys are merged into the
+ * track in a single pass.
+ */
+int anm_set_keyframes(struct anm_track *track, const struct anm_keyframe *keys, int count);
 
-/* get the idx-th keyframe, returns null if it doesn't exist */
+/* get the idx-th keyframe, returns null if it doesn't exist
+ * For tracks not using ANM_KEYS_AOS the returned keyframe is a copy, which is
+ * only valid until the next call, and modifying it doesn't affect the track.
+ * The copy is stored in the track, so it's not safe to call this concurrently
+ * on such tracks; use anm_get_keyframe_copy instead.
+ */
 struct anm_keyframe *anm_get_keyframe(const struct anm_track *track, int idx);
+/* copies the idx-th keyframe to key, returns -1 if it doesn't exist */
+int anm_get_keyframe_copy(const struct anm_track *track, int idx, struct anm_keyframe *key);
+
+/* Removes keyframes which can be reconstructed by interpolating the remaining
+ * ones, to within max_err of the original track at every original keyframe
+ * and half-way between consecutive keyframes. The first and last keyframes
+ * are always kept. Returns the number of keyframes removed, or -1 on failure.
+ */
+int anm_simplify_track(struct anm_track *track, float max_err);
+/* Simplifies up to 4 tracks holding the components of a vector together.
+ * Keyframes are only removed if they can be removed from all of them, and
+ * the error is measured as the distance between the original and simplified
+ * vectors. If the tracks don't share the same key times, each one is
+ * simplified separately with a tolerance of max_err / sqrt(count).
+ */
+int anm_simplify_tracks(struct anm_track **tracks, int count, float max_err);
+/* Simplifies the four tracks of a rotation quaternion, as interpolated by
+ * anm_get_quat. The error is the angle (in radians) of the rotation between
+ * the original and simplified orientations. The tracks must have the same key
+ * times, otherwise -1 is returned.
+ */
+int anm_simplify_quat(struct anm_track *xtrk, struct anm_track *ytrk,
+		struct anm_track *ztrk, struct anm_track *wtrk, float max_angle);
 
 /* Finds the 0-based index of the intra-keyframe interval which corresponds
  * to the specified time. If the time falls exactly onto the N-th keyframe
- * the function returns N.
+ * the function returns N. Tracks with many thousands of keyframes maintain a
+ * cache-friendly search index, which is used instead of plain bisection.
  *
  * Special cases:
  * - if the time is before the first keyframe -1 is returned.
@@ -109,17 +329,175 @@ struct anm_keyframe *anm_get_keyframe(const struct anm_track *track, int idx);
  */
 int anm_get_key_interval(const struct anm_track *track, anm_time_t tm);
 
+void anm_init_cursor(struct anm_cursor *cur);
+
+/* same as anm_get_key_interval, but starts looking from the interval last
+ * found through the cursor, and updates it before returning.
+ */
+int anm_get_key_interval_cursor(const struct anm_track *track, anm_time_t tm,
+		struct anm_cursor *cur);
+
 int anm_set_value(struct anm_track *track, anm_time_t tm, float val);
 
 /* evaluates and returns the value of the track for a particular time */
 float anm_get_value(const struct anm_track *track, anm_time_t tm);
+/* same as anm_get_value, using a lookup cursor (see struct anm_cursor) */
+float anm_get_value_cursor(const struct anm_track *track, anm_time_t tm,
+		struct anm_cursor *cur);
+
+/* Evaluates the track at n different times, writing the results to out.
+ * Equivalent to calling anm_get_value for each time, but considerably faster
+ * for large batches, and especially if the times are sorted, in which case the
+ * keyframe intervals are found with a single sweep over the track.
+ */
+void anm_get_values(const struct anm_track *track, const anm_time_t *times, int n, float *out);
 
 /* evaluates a set of 4 tracks treated as a quaternion, to perform slerp instead
  * of linear interpolation. Result is returned through the last argument, which
  * is expected to point to an array of 4 floats (x,y,z,w)
+ *
+ * If the ANM_TRACK_SLERP_CACHE option is enabled on xtrk, the angle between the
+ * ends of each segment is calculated once and kept in xtrk, and recalculated
+ * only when any of the 4 tracks change.
  */
 void anm_get_quat(const struct anm_track *xtrk, const struct anm_track *ytrk,
 		const struct anm_track *ztrk, const struct anm_track *wtrk, anm_time_t tm, float *qres);
+/* same as anm_get_quat, using a lookup cursor for the key times of xtrk */
+void anm_get_quat_cursor(const struct anm_track *xtrk, const struct anm_track *ytrk,
+		const struct anm_track *ztrk, const struct anm_track *wtrk, anm_time_t tm,
+		float *qres, struct anm_cursor *cur);
+
+/* ---- 3D vector tracks ---- */
+
+int anm_init_vec3_track(struct anm_vec3_track *track);
+void anm_destroy_vec3_track(struct anm_vec3_track *track);
+
+/* copies track src to dest, dest must have been initialized first */
+int anm_copy_vec3_track(struct anm_vec3_track *dest, const struct anm_vec3_track *src);
+
+void anm_set_vec3_track_interpolator(struct anm_vec3_track *track, enum anm_interpolator in);
+void anm_set_vec3_track_extrapolator(struct anm_vec3_track *track, enum anm_extrapolator ex);
+/* default value of the track when it has no keyframes (0, 0, 0 if unset) */
+void anm_set_vec3_track_default(struct anm_vec3_track *track, const float *v);
+
+/* set or update the keyframe at time tm */
+int anm_set_vec3_keyframe(struct anm_vec3_track *track, anm_time_t tm, const float *v);
+/* get the time and value of the idx-th keyframe, returns -1 if it doesn't exist */
+int anm_get_vec3_keyframe(const struct anm_vec3_track *track, int idx, anm_time_t *tm, float *v);
+
+/* same as anm_get_key_interval, for 3D vector tracks */
+int anm_get_vec3_key_interval(const struct anm_vec3_track *track, anm_time_t tm);
+
+/* evaluate the track at time tm */
+void anm_get_vec3_value(const struct anm_vec3_track *track, anm_time_t tm, float *res);
+void anm_get_vec3_value_cursor(const struct anm_vec3_track *track, anm_time_t tm,
+		float *res, struct anm_cursor *cur);
+
+/* same as anm_simplify_tracks, for 3D vector tracks */
+int anm_simplify_vec3_track(struct anm_vec3_track *track, float max_err);
+
+/* ---- quaternion rotation tracks ---- */
+
+int anm_init_quat_track(struct anm_quat_track *track);
+void anm_destroy_quat_track(struct anm_quat_track *track);
+
+/* copies track src to dest, dest must have been initialized first */
+int anm_copy_quat_track(struct anm_quat_track *dest, const struct anm_quat_track *src);
+
+void anm_set_quat_track_interpolator(struct anm_quat_track *track, enum anm_interpolator in);
+void anm_set_quat_track_extrapolator(struct anm_quat_track *track, enum anm_extrapolator ex);
+/* default rotation of the track when it has no keyframes (identity if unset) */
+void anm_set_quat_track_default(struct anm_quat_track *track, const float *q);
+
+/* set or update the rotation keyframe at time tm */
+int anm_set_quat_keyframe(struct anm_quat_track *track, anm_time_t tm, const float *q);
+/* get the time and rotation of the idx-th keyframe, returns -1 if it doesn't exist */
+int anm_get_quat_keyframe(const struct anm_quat_track *track, int idx, anm_time_t *tm, float *q);
+
+/* same as anm_get_key_interval, for rotation tracks */
+int anm_get_quat_key_interval(const struct anm_quat_track *track, anm_time_t tm);
+
+/* evaluate the rotation track at time tm */
+void anm_get_quat_value(const struct anm_quat_track *track, anm_time_t tm, float *qres);
+void anm_get_quat_value_cursor(const struct anm_quat_track *track, anm_time_t tm,
+		float *qres, struct anm_cursor *cur);
+
+/* same as anm_simplify_quat, for rotation tracks */
+int anm_simplify_quat_track(struct anm_quat_track *track, float max_angle);
+
+/* ---- streaming tracks ---- */
+
+/* capacity is the number of keyframes kept, rounded up to a power of two */
+int anm_init_stream_track(struct anm_stream_track *track, int capacity);
+void anm_destroy_stream_track(struct anm_stream_track *track);
+
+void anm_set_stream_track_interpolator(struct anm_stream_track *track, enum anm_interpolator in);
+void anm_set_stream_track_extrapolator(struct anm_stream_track *track, enum anm_extrapolator ex);
+void anm_set_stream_track_default(struct anm_stream_track *track, float def);
+
+/* Appends a keyframe after the last one, replacing the oldest keyframe if
+ * the track is full. A keyframe at the time of the last one updates its
+ * value. Returns -1 if tm is earlier than the last keyframe.
+ */
+int anm_append_stream_keyframe(struct anm_stream_track *track, anm_time_t tm, float val);
+/* removes all keyframes */
+void anm_clear_stream_track(struct anm_stream_track *track);
+
+/* get the time and value of the idx-th keyframe, counting from the oldest one
+ * still in the track. Returns -1 if it doesn't exist.
+ */
+int anm_get_stream_keyframe(const struct anm_stream_track *track, int idx, anm_time_t *tm, float *val);
+
+/* evaluate the streaming track at time tm, same as anm_get_value */
+float anm_get_stream_value(const struct anm_stream_track *track, anm_time_t tm);
+
+/* ---- event tracks ---- */
+
+int anm_init_event_track(struct anm_event_track *track);
+void anm_destroy_event_track(struct anm_event_track *track);
+
+void anm_set_event_track_extrapolator(struct anm_event_track *track, enum anm_extrapolator ex);
+/* Sets the time range repeated by ANM_EXTRAP_REPEAT and ANM_EXTRAP_PINGPONG,
+ * which is normally the range of the animation the events belong to. With
+ * those two extrapolators, events outside of the range never occur. The range
+ * doesn't affect the other extrapolators, where every event occurs once, at
+ * its time. By default the range spans from the first to the last event, so
+ * with ANM_EXTRAP_REPEAT those two occur together, at the end of every
+ * repetition and the start of the next one.
+ */
+void anm_set_event_track_range(struct anm_event_track *track, anm_time_t start, anm_time_t end);
+
+/* Adds an event at time tm. Events at the same time are kept in the order
+ * they were added. Returns -1 on failure.
+ */
+int anm_add_event(struct anm_event_track *track, anm_time_t tm, int id);
+/* removes the idx-th event, in time order */
+int anm_remove_event(struct anm_event_track *track, int idx);
+/* removes all events */
+void anm_clear_event_track(struct anm_event_track *track);
+/* get the idx-th event in time order, returns null if it doesn't exist */
+const struct anm_event *anm_get_event(const struct anm_event_track *track, int idx);
+
+/* Finds the events which occur after t0, and up to and including t1, and
+ * writes up to max of them to res, in the order they occur. The time of each
+ * result is the time of that occurrence of the event, which differs from the
+ * time of the event itself if it's repeated by the extrapolator.
+ * Returns the number of events written, which is 0 if t1 <= t0.
+ * The events are found with a binary search, plus one per repetition of the
+ * range spanned by the interval.
+ */
+int anm_get_events(const struct anm_event_track *track, anm_time_t t0, anm_time_t t1,
+		struct anm_event *res, int max);
+/* Performs the same query for n different intervals, (t0[i], t1[i]], as for
+ * many instances of an animation playing at different times. The events of
+ * every interval are written to res one after the other, and the events of
+ * interval i start at res[first[i]], with first[n] holding the total count,
+ * so first must have room for n + 1 integers. If res fills up, the remaining
+ * intervals are left without results.
+ * Returns the total number of events written.
+ */
+int anm_get_events_batch(const struct anm_event_track *track, const anm_time_t *t0,
+		const anm_time_t *t1, int n, struct anm_event *res, int max, int *first);
 
 #ifdef __cplusplus
 }
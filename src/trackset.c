@@ -0,0 +1,555 @@
+/*
+libanim - hierarchical keyframe animation library
+Copyright (C) 2012-2023 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "trackset.h"
+#include "dynarr.h"
+
+struct anm_tset_entry {
+	const struct anm_track *trk;
+	/* state of the track when the packed keyframes were built */
+	unsigned int rev;
+	enum anm_interpolator interp;
+	enum anm_extrapolator extrap;
+	float def_val;
+};
+
+/* tracks with identical key times, interpolator and extrapolator */
+struct anm_tset_group {
+	const struct anm_track *trk;	/* first track of the group, for anm_remap_time */
+	int ntrk, nkeys;
+	enum anm_interpolator interp;
+	anm_time_t *times;
+	float *vals;	/* ntrk values per keyframe, all tracks of each keyframe together */
+	int *dest;		/* output index of each track */
+	int cur;		/* last keyframe interval found */
+};
+
+/* tracks which don't share their key times with any other */
+struct anm_tset_loose {
+	int count;
+	const struct anm_track **trk;
+	enum anm_interpolator *interp;
+	int *start, *nkeys;		/* range of each track's keys in times/vals */
+	anm_time_t *times;
+	float *vals;
+	int *dest;
+	int *cur;
+	/* the cubic polynomial coefficients of the current segment of each track,
+	 * and its interpolation parameter, gathered before interpolation.
+	 */
+	float *ca, *cb, *cc, *cd, *t;
+};
+
+static int tracks_changed(const struct anm_trackset *set);
+static int build(struct anm_trackset *set);
+static void free_packed(struct anm_trackset *set);
+static void free_group(struct anm_tset_group *g);
+static void free_loose(struct anm_tset_loose *l);
+static int alloc_loose(struct anm_tset_loose *l, int count, int nkeys);
+static void eval_group(struct anm_tset_group *g, anm_time_t tm, float *out, float *res);
+static void eval_loose(struct anm_tset_loose *l, anm_time_t tm, float *out, float *res);
+static int find_interval(const anm_time_t *times, int count, anm_time_t tm, int *cur);
+
+int anm_init_trackset(struct anm_trackset *set)
+{
+	memset(set, 0, sizeof *set);
+
+	if(!(set->entries = anm_dynarr_alloc(0, sizeof *set->entries))) {
+		return -1;
+	}
+	return 0;
+}
+
+void anm_destroy_trackset(struct anm_trackset *set)
+{
+	free_packed(set);
+	anm_dynarr_free(set->entries);
+}
+
+struct anm_trackset *anm_create_trackset(void)
+{
+	struct anm_trackset *set;
+
+	if((set = malloc(sizeof *set))) {
+		if(anm_init_trackset(set) == -1) {
+			free(set);
+			return 0;
+		}
+	}
+	return set;
+}
+
+void anm_free_trackset(struct anm_trackset *set)
+{
+	anm_destroy_trackset(set);
+	free(set);
+}
+
+int anm_add_trackset_track(struct anm_trackset *set, const struct anm_track *track)
+{
+	void *tmp;
+	struct anm_tset_entry ent;
+
+	memset(&ent, 0, sizeof ent);
+	ent.trk = track;
+
+	if(!(tmp = anm_dynarr_push(set->entries, &ent))) {
+		return -1;
+	}
+	set->entries = tmp;
+	set->valid = 0;
+	return set->count++;
+}
+
+void anm_clear_trackset(struct anm_trackset *set)
+{
+	void *tmp;
+
+	free_packed(set);
+	if((tmp = anm_dynarr_resize(set->entries, 0))) {
+		set->entries = tmp;
+	}
+	set->count = 0;
+}
+
+int anm_get_trackset_size(const struct anm_trackset *set)
+{
+	return set->count;
+}
+
+int anm_update_trackset(struct anm_trackset *set)
+{
+	if(set->valid && !tracks_changed(set)) {
+		return 0;
+	}
+	free_packed(set);
+	if(build(set) == -1) {
+		free_packed(set);
+		return -1;
+	}
+	set->valid = 1;
+	return 0;
+}
+
+void anm_eval_trackset(struct anm_trackset *set, anm_time_t tm, float *out)
+{
+	int i;
+
+	if(anm_update_trackset(set) == -1) {
+		for(i=0; i<set->count; i++) {
+			out[i] = anm_get_value(set->entries[i].trk, tm);
+		}
+		return;
+	}
+
+	for(i=0; i<set->num_const; i++) {
+		out[set->const_dest[i]] = set->const_val[i];
+	}
+	for(i=0; i<set->num_groups; i++) {
+		eval_group(set->groups + i, tm, out, set->tmp);
+	}
+	if(set->loose) {
+		eval_loose(set->loose, tm, out, set->tmp);
+	}
+}
+
+static int tracks_changed(const struct anm_trackset *set)
+{
+	int i;
+	const struct anm_tset_entry *ent = set->entries;
+
+	for(i=0; i<set->count; i++) {
+		const struct anm_track *trk = ent[i].trk;
+		if(trk->rev != ent[i].rev || trk->interp != ent[i].interp ||
+				trk->extrap != ent[i].extrap || trk->def_val != ent[i].def_val) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* extracts the key times of all tracks, and sorts the tracks into groups with
+ * the same key times, loose tracks, and constants.
+ */
+static int build(struct anm_trackset *set)
+{
+	int i, j, k, m, n, total = 0, nloose = 0, nloose_keys = 0;
+	int *start = 0, *group = 0, *members = 0;
+	anm_time_t *times = 0;
+	struct anm_tset_entry *ent = set->entries;
+	struct anm_tset_group *g;
+	struct anm_tset_loose *l;
+	struct anm_keyframe key;
+	int res = -1;
+
+	if(!set->count) {
+		return 0;
+	}
+
+	if(!(start = malloc(set->count * sizeof *start)) ||
+			!(group = malloc(set->count * sizeof *group)) ||
+			!(members = malloc(set->count * sizeof *members)) ||
+			!(set->tmp = malloc(set->count * sizeof *set->tmp)) ||
+			!(set->const_val = malloc(set->count * sizeof *set->const_val)) ||
+			!(set->const_dest = malloc(set->count * sizeof *set->const_dest)) ||
+			!(set->groups = malloc((set->count / 2 + 1) * sizeof *set->groups))) {
+		goto end;
+	}
+
+	for(i=0; i<set->count; i++) {
+		const struct anm_track *trk = ent[i].trk;
+
+		ent[i].rev = trk->rev;
+		ent[i].interp = trk->interp;
+		ent[i].extrap = trk->extrap;
+		ent[i].def_val = trk->def_val;
+
+		start[i] = total;
+		total += trk->count;
+	}
+
+	if(total && !(times = malloc(total * sizeof *times))) {
+		goto end;
+	}
+
+	for(i=0; i<set->count; i++) {
+		const struct anm_track *trk = ent[i].trk;
+
+		for(j=0; j<trk->count; j++) {
+			anm_get_keyframe_copy(trk, j, &key);
+			times[start[i] + j] = key.time;
+		}
+
+		group[i] = -1;
+		if(trk->count < 2) {
+			/* evaluates to the same value at any time */
+			set->const_val[set->num_const] = anm_get_keyframe_copy(trk, 0, &key) != -1 ? key.val : trk->def_val;
+			set->const_dest[set->num_const++] = i;
+			group[i] = -2;
+		}
+	}
+
+	for(i=0; i<set->count; i++) {
+		const struct anm_track *trk = ent[i].trk;
+		if(group[i] != -1) continue;
+
+		n = 0;
+		members[n++] = i;
+		for(j=i+1; j<set->count; j++) {
+			const struct anm_track *other = ent[j].trk;
+			if(group[j] != -1 || other->count != trk->count || other->interp != trk->interp ||
+					other->extrap != trk->extrap) {
+				continue;
+			}
+			if(memcmp(times + start[i], times + start[j], trk->count * sizeof *times) == 0) {
+				members[n++] = j;
+			}
+		}
+
+		if(n < 2) {
+			nloose++;
+			nloose_keys += trk->count;
+			continue;
+		}
+
+		g = set->groups + set->num_groups;
+		memset(g, 0, sizeof *g);
+		g->trk = trk;
+		g->ntrk = n;
+		g->nkeys = trk->count;
+		g->interp = trk->interp;
+		g->cur = -1;
+
+		if(!(g->times = malloc(g->nkeys * sizeof *g->times)) ||
+				!(g->vals = malloc(g->nkeys * n * sizeof *g->vals)) ||
+				!(g->dest = malloc(n * sizeof *g->dest))) {
+			free_group(g);
+			goto end;
+		}
+		set->num_groups++;
+
+		memcpy(g->times, times + start[i], g->nkeys * sizeof *g->times);
+		for(j=0; j<n; j++) {
+			m = members[j];
+			group[m] = set->num_groups - 1;
+			g->dest[j] = m;
+			for(k=0; k<g->nkeys; k++) {
+				anm_get_keyframe_copy(ent[m].trk, k, &key);
+				g->vals[k * n + j] = key.val;
+			}
+		}
+	}
+
+	if(nloose) {
+		if(!(l = malloc(sizeof *l))) {
+			goto end;
+		}
+		if(alloc_loose(l, nloose, nloose_keys) == -1) {
+			free(l);
+			goto end;
+		}
+		set->loose = l;
+
+		n = 0;
+		k = 0;
+		for(i=0; i<set->count; i++) {
+			const struct anm_track *trk = ent[i].trk;
+			if(group[i] != -1) continue;
+
+			l->trk[n] = trk;
+			l->interp[n] = trk->interp;
+			l->start[n] = k;
+			l->nkeys[n] = trk->count;
+			l->dest[n] = i;
+			l->cur[n] = -1;
+			memcpy(l->times + k, times + start[i], trk->count * sizeof *times);
+			for(j=0; j<trk->count; j++) {
+				anm_get_keyframe_copy(trk, j, &key);
+				l->vals[k + j] = key.val;
+			}
+			k += trk->count;
+			n++;
+		}
+	}
+	res = 0;
+
+end:
+	free(start);
+	free(group);
+	free(members);
+	free(times);
+	return res;
+}
+
+static void free_packed(struct anm_trackset *set)
+{
+	int i;
+
+	for(i=0; i<set->num_groups; i++) {
+		free_group(set->groups + i);
+	}
+	free(set->groups);
+	if(set->loose) {
+		free_loose(set->loose);
+		free(set->loose);
+	}
+	free(set->const_val);
+	free(set->const_dest);
+	free(set->tmp);
+
+	set->groups = 0;
+	set->num_groups = 0;
+	set->loose = 0;
+	set->const_val = 0;
+	set->const_dest = 0;
+	set->num_const = 0;
+	set->tmp = 0;
+	set->valid = 0;
+}
+
+static void free_group(struct anm_tset_group *g)
+{
+	free(g->times);
+	free(g->vals);
+	free(g->dest);
+}
+
+static int alloc_loose(struct anm_tset_loose *l, int count, int nkeys)
+{
+	memset(l, 0, sizeof *l);
+	l->count = count;
+
+	if(!(l->trk = malloc(count * sizeof *l->trk)) ||
+			!(l->interp = malloc(count * sizeof *l->interp)) ||
+			!(l->start = malloc(count * sizeof *l->start)) ||
+			!(l->nkeys = malloc(count * sizeof *l->nkeys)) ||
+			!(l->dest = malloc(count * sizeof *l->dest)) ||
+			!(l->cur = malloc(count * sizeof *l->cur)) ||
+			!(l->times = malloc(nkeys * sizeof *l->times)) ||
+			!(l->vals = malloc(nkeys * sizeof *l->vals)) ||
+			!(l->ca = malloc(count * sizeof *l->ca)) ||
+			!(l->cb = malloc(count * sizeof *l->cb)) ||
+			!(l->cc = malloc(count * sizeof *l->cc)) ||
+			!(l->cd = malloc(count * sizeof *l->cd)) ||
+			!(l->t = malloc(count * sizeof *l->t))) {
+		free_loose(l);
+		return -1;
+	}
+	return 0;
+}
+
+static void free_loose(struct anm_tset_loose *l)
+{
+	free(l->trk);
+	free(l->interp);
+	free(l->start);
+	free(l->nkeys);
+	free(l->dest);
+	free(l->cur);
+	free(l->times);
+	free(l->vals);
+	free(l->ca);
+	free(l->cb);
+	free(l->cc);
+	free(l->cd);
+	free(l->t);
+}
+
+/* A group is evaluated with a single keyframe search, and then each
+ * interpolation loop runs across the contiguous values of all tracks of the
+ * group, for the compiler to vectorize.
+ */
+static void eval_group(struct anm_tset_group *g, anm_time_t tm, float *out, float *res)
+{
+	int i, idx, n = g->ntrk, last = g->nkeys - 1;
+	float t, tsq, x, y, z, w;
+	const float *v0, *v1, *v2, *v3;
+
+	tm = anm_remap_time(g->trk, tm, g->times[0], g->times[last]);
+	idx = find_interval(g->times, g->nkeys, tm, &g->cur);
+
+	t = (float)(tm - g->times[idx]) / (float)(g->times[idx + 1] - g->times[idx]);
+
+	v1 = g->vals + idx * n;
+	v2 = v1 + n;
+	v0 = idx > 0 ? v1 - n : v1;
+	v3 = idx + 1 < last ? v2 + n : v2;
+
+	switch(g->interp) {
+	case ANM_INTERP_STEP:
+		for(i=0; i<n; i++) {
+			res[i] = v1[i];
+		}
+		break;
+
+	case ANM_INTERP_LINEAR:
+		for(i=0; i<n; i++) {
+			res[i] = v1[i] + (v2[i] - v1[i]) * t;
+		}
+		break;
+
+	case ANM_INTERP_CUBIC:
+		tsq = t * t;
+		for(i=0; i<n; i++) {
+			x = -v0[i] + 3.0f * v1[i] - 3.0f * v2[i] + v3[i];
+			y = 2.0f * v0[i] - 5.0f * v1[i] + 4.0f * v2[i] - v3[i];
+			z = v2[i] - v0[i];
+			w = 2.0f * v1[i];
+			res[i] = 0.5f * (x * tsq * t + y * tsq + z * t + w);
+		}
+		break;
+	}
+
+	for(i=0; i<n; i++) {
+		out[g->dest[i]] = res[i];
+	}
+}
+
+/* Loose tracks are searched one by one, and the cubic polynomial of their
+ * current segment is gathered into arrays (step and linear interpolation are
+ * polynomials of lower degree), which are then evaluated together.
+ */
+static void eval_loose(struct anm_tset_loose *l, anm_time_t tm, float *out, float *res)
+{
+	int i, idx, last;
+	anm_time_t ltm;
+	const anm_time_t *times;
+	const float *vals;
+	float v0, v1, v2, v3;
+
+	for(i=0; i<l->count; i++) {
+		times = l->times + l->start[i];
+		vals = l->vals + l->start[i];
+		last = l->nkeys[i] - 1;
+
+		ltm = anm_remap_time(l->trk[i], tm, times[0], times[last]);
+		idx = find_interval(times, l->nkeys[i], ltm, l->cur + i);
+
+		l->t[i] = (float)(ltm - times[idx]) / (float)(times[idx + 1] - times[idx]);
+
+		v1 = vals[idx];
+		v2 = vals[idx + 1];
+
+		switch(l->interp[i]) {
+		case ANM_INTERP_STEP:
+			l->ca[i] = l->cb[i] = l->cc[i] = 0.0f;
+			l->cd[i] = v1;
+			break;
+
+		case ANM_INTERP_LINEAR:
+			l->ca[i] = l->cb[i] = 0.0f;
+			l->cc[i] = v2 - v1;
+			l->cd[i] = v1;
+			break;
+
+		case ANM_INTERP_CUBIC:
+			v0 = idx > 0 ? vals[idx - 1] : v1;
+			v3 = idx + 1 < last ? vals[idx + 2] : v2;
+			l->ca[i] = 0.5f * (-v0 + 3.0f * v1 - 3.0f * v2 + v3);
+			l->cb[i] = 0.5f * (2.0f * v0 - 5.0f * v1 + 4.0f * v2 - v3);
+			l->cc[i] = 0.5f * (v2 - v0);
+			l->cd[i] = v1;
+			break;
+		}
+	}
+
+	for(i=0; i<l->count; i++) {
+		res[i] = ((l->ca[i] * l->t[i] + l->cb[i]) * l->t[i] + l->cc[i]) * l->t[i] + l->cd[i];
+	}
+
+	for(i=0; i<l->count; i++) {
+		out[l->dest[i]] = res[i];
+	}
+}
+
+/* Finds the keyframe interval of a time within the range of the keys (after
+ * extrapolation), with the same results as anm_get_key_interval. The interval
+ * found last time, and the one after it, are checked before searching.
+ */
+static int find_interval(const anm_time_t *times, int count, anm_time_t tm, int *cur)
+{
+	int idx = *cur, last = count - 1, lo, hi, mid;
+
+	assert(count >= 2 && tm >= times[0] && tm <= times[last]);
+
+	if(idx >= 0 && tm >= times[idx]) {
+		if(idx + 1 == last || tm < times[idx + 1]) {
+			return idx;
+		}
+		if(++idx + 1 == last || tm < times[idx + 1]) {
+			*cur = idx;
+			return idx;
+		}
+	}
+
+	/* exact hits on the last keyframe end up in the last interval */
+	lo = 0;
+	hi = last;
+	while(hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if(times[mid] <= tm) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	*cur = lo;
+	return lo;
+}
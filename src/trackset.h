@@ -0,0 +1,101 @@
+/*
+libanim - hierarchical keyframe animation library
+Copyright (C) 2012-2023 John Tsiombikas <nuclear@member.fsf.org>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published
+by the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* A track set evaluates a large number of scalar tracks (blend shape weights,
+ * material parameters, etc) at the same time, into an array of values.
+ *
+ * The set keeps packed copies of the keyframes of its tracks, in a form which
+ * lets it interpolate many tracks with a single loop. Tracks with identical
+ * key times, interpolator and extrapolator are grouped together, and the
+ * values of each keyframe of a group are stored contiguously, so a group is
+ * evaluated with a single keyframe search, and one interpolation loop across
+ * all its tracks. The rest of the tracks are searched individually, and
+ * their interpolation inputs are gathered into arrays, which are then
+ * interpolated together.
+ *
+ * The packed data are rebuilt automatically when any of the tracks changes,
+ * so the tracks must stay alive for as long as they are part of the set.
+ * Evaluation updates the set, so it must not be evaluated concurrently from
+ * multiple threads.
+ */
+#ifndef LIBANIM_TRACKSET_H_
+#define LIBANIM_TRACKSET_H_
+
+#include "track.h"
+
+struct anm_tset_entry;
+struct anm_tset_group;
+struct anm_tset_loose;
+
+struct anm_trackset {
+	int count;
+	struct anm_tset_entry *entries;		/* tracks of the set, in output order */
+
+	/* packed keyframes, built from the tracks by anm_update_trackset */
+	int valid;
+	int num_groups;
+	struct anm_tset_group *groups;
+	struct anm_tset_loose *loose;	/* tracks which don't share key times */
+	int num_const;
+	float *const_val;		/* tracks with less than two keyframes */
+	int *const_dest;
+
+	float *tmp;				/* per-track scratch space for evaluation */
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* track set constructor and destructor */
+int anm_init_trackset(struct anm_trackset *set);
+void anm_destroy_trackset(struct anm_trackset *set);
+
+/* helper functions that use anm_init_trackset and anm_destroy_trackset internally */
+struct anm_trackset *anm_create_trackset(void);
+void anm_free_trackset(struct anm_trackset *set);
+
+/* Adds a track to the set. The track is not copied, and it must outlive the
+ * set, or be removed with anm_clear_trackset.
+ * Returns the index of the track's value in the output of anm_eval_trackset,
+ * or -1 on failure.
+ */
+int anm_add_trackset_track(struct anm_trackset *set, const struct anm_track *track);
+/* removes all tracks from the set */
+void anm_clear_trackset(struct anm_trackset *set);
+
+int anm_get_trackset_size(const struct anm_trackset *set);
+
+/* Rebuilds the packed keyframes if any of the tracks has changed since the
+ * last update. Called by anm_eval_trackset, but it can be called explicitly
+ * after editing the tracks, to avoid the cost on the next evaluation.
+ * Returns -1 on failure.
+ */
+int anm_update_trackset(struct anm_trackset *set);
+
+/* Evaluates all tracks of the set at time tm, and writes their values to the
+ * out array, which must have room for anm_get_trackset_size floats.
+ * Cubic interpolation results may differ from anm_get_value by rounding.
+ */
+void anm_eval_trackset(struct anm_trackset *set, anm_time_t tm, float *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif	/* LIBANIM_TRACKSET_H_ */